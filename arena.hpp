@@ -0,0 +1,125 @@
+
+/*
+ * Arena allocation for scene data and per-tile scratch memory
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+namespace rt {
+
+// A monotonic ("bump") allocator, usable with the std::pmr containers.
+//
+// Memory is handed out from large blocks obtained from an upstream
+// resource, and individual deallocations are ignored. Unlike
+// std::pmr::monotonic_buffer_resource, reset() keeps the memory, merging the
+// blocks into one of their total size if more than one was needed. An arena
+// which is reset after each unit of work (for example, each tile) therefore
+// settles at a single block as large as the most any unit has needed, and
+// then stops allocating from upstream, whatever sequence of allocations each
+// unit makes.
+//
+// Arenas are not thread-safe, and any containers using an arena must be
+// destroyed (or never used again) before it is reset or destroyed.
+class arena : public std::pmr::memory_resource {
+public:
+    explicit arena(std::size_t block_size = 64 * 1024,
+                   std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+            : block_size_{block_size},
+              upstream_{upstream}
+    {}
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    ~arena() override { release(); }
+
+    // Makes all of the arena's memory available for reuse
+    void reset()
+    {
+        if (blocks_.size() > 1) {
+            const std::size_t size = get_capacity();
+            release();
+            // blocks_ already has room, so this doesn't allocate
+            blocks_.push_back({static_cast<std::byte*>(upstream_->allocate(size, alignof(std::max_align_t))), size});
+        }
+        current_ = 0;
+        offset_ = 0;
+    }
+
+    // The total size of the blocks obtained from upstream
+    std::size_t get_capacity() const
+    {
+        std::size_t total = 0;
+        for (const auto& b : blocks_) {
+            total += b.size;
+        }
+        return total;
+    }
+
+private:
+    struct block {
+        std::byte* data;
+        std::size_t size;
+    };
+
+    // Returns every block to upstream
+    void release()
+    {
+        for (const auto& b : blocks_) {
+            upstream_->deallocate(b.data, b.size, alignof(std::max_align_t));
+        }
+        blocks_.clear();
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        for (; current_ < blocks_.size(); current_++, offset_ = 0) {
+            const auto base = reinterpret_cast<std::uintptr_t>(blocks_[current_].data);
+            const auto start = (base + offset_ + alignment - 1) & ~std::uintptr_t(alignment - 1);
+            if (start + bytes <= base + blocks_[current_].size) {
+                offset_ = start + bytes - base;
+                return reinterpret_cast<void*>(start);
+            }
+        }
+
+        // Nothing left fits, so add a new block and try again
+        const std::size_t size = std::max(block_size_, bytes + alignment);
+        blocks_.push_back({static_cast<std::byte*>(upstream_->allocate(size, alignof(std::max_align_t))), size});
+        return do_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    std::size_t block_size_;
+    std::pmr::memory_resource* upstream_;
+    std::vector<block> blocks_;
+    std::size_t current_ = 0;
+    std::size_t offset_ = 0;
+};
+
+} // end namespace rt
@@ -0,0 +1,200 @@
+
+/*
+ * Asynchronous rendering on a shared thread pool, yielding tiles as they finish
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "render_control.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace rt {
+
+namespace detail {
+
+// The state a tile_stream shares with the tasks rendering its tiles
+struct tile_stream_state {
+    tile_stream_state(const ray_tracer& tracer_, int tile_count_)
+            : tracer{tracer_},
+              tile_count{tile_count_},
+              remaining{tile_count_}
+    {}
+
+    ray_tracer tracer;
+    int tile_count;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<tile> finished;
+    int remaining;
+    int skipped = 0;
+    // Only used for its statistics, as in render_parallel()
+    shadow_cache cache_totals{};
+};
+
+} // end namespace detail
+
+// A handle to a render started by render_async(), through which the caller
+// receives the tiles of the image as they are finished.
+//
+// Destroying a tile_stream waits for its render, since the render refers to
+// the caller's scene and canvas.
+class tile_stream {
+public:
+    tile_stream() = default;
+
+    explicit tile_stream(std::shared_ptr<detail::tile_stream_state> state)
+            : state_{std::move(state)}
+    {}
+
+    tile_stream(tile_stream&&) = default;
+    tile_stream& operator=(tile_stream&& other)
+    {
+        wait();
+        state_ = std::move(other.state_);
+        return *this;
+    }
+
+    ~tile_stream() { wait(); }
+
+    // Waits for the next tile to be finished and returns it, or returns
+    // nullopt once every tile has been returned (or skipped, if a stop was
+    // requested). Tiles are returned in the order they finish, which is not
+    // necessarily the order they were queued in.
+    std::optional<tile> next()
+    {
+        if (!state_) {
+            return std::nullopt;
+        }
+        std::unique_lock<std::mutex> lock{state_->mutex};
+        state_->changed.wait(lock, [this] { return !state_->finished.empty() || state_->remaining == 0; });
+        return pop_finished();
+    }
+
+    // As next(), but returns nullopt straight away if no tile is ready
+    std::optional<tile> try_next()
+    {
+        if (!state_) {
+            return std::nullopt;
+        }
+        std::lock_guard<std::mutex> lock{state_->mutex};
+        return pop_finished();
+    }
+
+    // Waits for the render to finish, and returns true if every tile was
+    // rendered. Tiles which haven't been taken with next() are discarded.
+    bool wait()
+    {
+        if (!state_) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock{state_->mutex};
+        state_->changed.wait(lock, [this] { return state_->remaining == 0; });
+        if (shadow_cache* cache = state_->tracer.get_shadow_cache()) {
+            cache->add_stats(state_->cache_totals.get_stats());
+            state_->cache_totals = shadow_cache{};
+        }
+        state_->finished.clear();
+        return state_->skipped == 0;
+    }
+
+    // Returns true once every tile has been rendered or skipped
+    bool is_done() const
+    {
+        if (!state_) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock{state_->mutex};
+        return state_->remaining == 0;
+    }
+
+    int get_tile_count() const { return state_ ? state_->tile_count : 0; }
+
+private:
+    // Called with the state's mutex held
+    std::optional<tile> pop_finished()
+    {
+        if (state_->finished.empty()) {
+            return std::nullopt;
+        }
+        const tile t = state_->finished.front();
+        state_->finished.pop_front();
+        return t;
+    }
+
+    std::shared_ptr<detail::tile_stream_state> state_;
+};
+
+// Starts rendering the scene onto the canvas on the given thread pool, and
+// returns at once with a tile_stream which yields each tile as it finishes,
+// so that the caller can encode, upload or display tiles while the rest are
+// still being traced.
+//
+// Each tile is queued on the pool as a task of its own at the given priority,
+// so any number of renders can share one pool, without threads of their own,
+// with their tiles interleaved in priority order. Tiles not yet started once
+// stop is requested are skipped. The image is the same as the one
+// render_parallel() would produce (and so as a single-threaded render).
+//
+// The scene and canvas must outlive the returned stream, and the canvas must
+// allow different pixels to be set from different threads at the same time.
+template <typename Scene, typename Canvas>
+tile_stream render_async(priority_thread_pool& pool, const ray_tracer& tracer, const Scene& scene,
+                         Canvas& canvas, int width, int height, const stop_token& stop = {},
+                         int tile_size = 32, int priority = 0)
+{
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tile_count = tiles_x * ((height + tile_size - 1) / tile_size);
+    auto st = std::make_shared<detail::tile_stream_state>(tracer, tile_count);
+    for (int i = 0; i < tile_count; i++) {
+        const int x = (i % tiles_x) * tile_size;
+        const int y = (i / tiles_x) * tile_size;
+        const tile tile_{x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)};
+        pool.submit(priority, [st, stop, tile_, &scene, &canvas, width, height] {
+            const bool skip = stop.stop_requested();
+            shadow_cache cache{};
+            if (!skip) {
+                if (st->tracer.get_shadow_cache()) {
+                    st->tracer.with_shadow_cache(cache).render_tile(scene, canvas, width, height, tile_);
+                } else {
+                    st->tracer.render_tile(scene, canvas, width, height, tile_);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock{st->mutex};
+                if (skip) {
+                    st->skipped++;
+                } else {
+                    st->finished.push_back(tile_);
+                    st->cache_totals.add_stats(cache.get_stats());
+                }
+                st->remaining--;
+            }
+            st->changed.notify_all();
+        });
+    }
+    return tile_stream{std::move(st)};
+}
+
+} // end namespace rt
@@ -0,0 +1,138 @@
+
+/*
+ * Rendering large batches of small images
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "byte_buffer.hpp"
+#include "dynamic_scene.hpp"
+#include "quantise.hpp"
+#include "render_control.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#include "stb_image_write.h"
+
+namespace rt {
+
+// One image of a batch: a scene, the camera to view it through, and the
+// image size. The scene is not copied, and may be shared between jobs.
+template <typename Scene>
+struct batch_job {
+    const Scene* scene;
+    camera cam;
+    int width;
+    int height;
+};
+
+struct batch_options {
+    int max_depth = 5;
+    quantise_options quantise{};
+    // Whether to PNG-encode each image before passing it on
+    bool png = false;
+    int priority = 0;
+};
+
+// A finished image, as passed to render_batch()'s callback. The canvas and
+// PNG data belong to the worker which rendered the image, and are reused for
+// its next one once the callback returns.
+struct batch_image {
+    std::size_t index;
+    const dynamic_canvas& canvas;
+    // The image as a PNG file, or empty unless batch_options::png is set
+    const std::vector<std::uint8_t>& png;
+};
+
+struct batch_stats {
+    std::size_t jobs = 0;
+    std::chrono::duration<double> elapsed{};
+
+    double get_jobs_per_second() const { return elapsed.count() > 0 ? jobs / elapsed.count() : 0.0; }
+};
+
+// Renders every job in the batch on the pool, calling on_image with each
+// finished image, and returns once they are all done.
+//
+// Rendering many small images one at a time spends much of its time on
+// per-render overheads, and splitting such small images into tiles leaves
+// threads waiting on each other. Instead, each of the pool's threads takes
+// whole jobs in turn (the largest first, so that no thread is left with a
+// big one at the end) and renders each on a single thread, into a canvas and
+// PNG buffer which it reuses from job to job. on_image is called on the
+// thread which rendered the image, so calls may overlap.
+template <typename Scene, typename OnImage>
+batch_stats render_batch(priority_thread_pool& pool, const std::vector<batch_job<Scene>>& jobs,
+                         OnImage&& on_image, const batch_options& opts = {})
+{
+    const auto start = render_clock::now();
+
+    std::vector<std::size_t> order(jobs.size());
+    std::iota(order.begin(), order.end(), std::size_t{0});
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        return jobs[a].width * jobs[a].height > jobs[b].width * jobs[b].height;
+    });
+
+    const ray_tracer tracer{opts.max_depth};
+    std::atomic<std::size_t> next_job{0};
+    const int workers = int(std::min(std::size_t(pool.get_thread_count()), jobs.size()));
+    int workers_left = workers;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    for (int w = 0; w < workers; w++) {
+        pool.submit(opts.priority, [&] {
+            std::optional<dynamic_canvas> canvas;
+            std::vector<std::uint8_t> png;
+            for (std::size_t i = next_job++; i < jobs.size(); i = next_job++) {
+                const batch_job<Scene>& job = jobs[order[i]];
+                if (!canvas || canvas->width != job.width || canvas->height != job.height) {
+                    canvas.emplace(job.width, job.height);
+                    canvas->set_quantise_options(opts.quantise);
+                }
+                tracer.render(detail::camera_view<Scene>{*job.scene, job.cam}, *canvas, job.width, job.height);
+                png.clear();
+                if (opts.png) {
+                    stbi_write_png_to_func(detail::append_to_vector, &png, job.width, job.height, 4,
+                                           canvas->get_pixels().data(), job.width * dynamic_canvas::bpp);
+                }
+                on_image(batch_image{order[i], *canvas, png});
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            if (--workers_left == 0) {
+                finished.notify_all();
+            }
+        });
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    finished.wait(lock, [&] { return workers_left == 0; });
+    return {jobs.size(), render_clock::now() - start};
+}
+
+} // end namespace rt
@@ -0,0 +1,756 @@
+
+/*
+ * Bounding volume hierarchy for run-time scenes
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+namespace detail {
+
+// Makes thing the closest hit if the ray hits it before closest_dist. Things
+// may either return a distance from intersect(), as any_thing does, or a
+// complete intersection, as instances do.
+template <typename Thing>
+void test_closer(const Thing& thing, const ray& ray_, intersection& closest, real_t& closest_dist)
+{
+    if constexpr (std::is_same_v<decltype(thing.intersect(ray_)), real_t>) {
+        if (const real_t dist = thing.intersect(ray_); dist < closest_dist) {
+            closest_dist = dist;
+            closest = {&thing, nullptr, dist};
+        }
+    } else {
+        if (const intersection inter = thing.intersect(ray_); inter.dist < closest_dist) {
+            closest_dist = inter.dist;
+            closest = inter;
+        }
+    }
+}
+
+// Returns the plane the thing is, if it is one
+template <typename Thing>
+const plane* as_plane(const Thing& thing)
+{
+    if constexpr (std::is_same_v<Thing, any_thing>) {
+        return thing.visit([](const auto& t) -> const plane* {
+            if constexpr (std::is_same_v<std::decay_t<decltype(t)>, plane>) {
+                return &t;
+            } else {
+                return nullptr;
+            }
+        });
+    } else {
+        return nullptr;
+    }
+}
+
+} // end namespace detail
+
+// The things without bounds, which a spatial index cannot place and so must
+// test against every ray. Keeping them apart means they never stretch the
+// index's bounds. Planes, the usual case, are stored as bare equations next
+// to their indices and tested without going through any_thing; anything
+// else unbounded is tested as it is.
+class unbounded_list {
+public:
+    explicit unbounded_list(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : planes_(mr),
+              others_(mr)
+    {}
+
+    void clear()
+    {
+        planes_.clear();
+        others_.clear();
+    }
+
+    // Adds thing, whose index is idx, and which must be unbounded
+    template <typename Thing>
+    void add(std::uint32_t idx, const Thing& thing)
+    {
+        if (const plane* p = detail::as_plane(thing)) {
+            planes_.push_back({p->norm, p->offset, idx});
+        } else {
+            others_.push_back(idx);
+        }
+    }
+
+    // Picks up planes which have moved. Returns false if one is no longer a
+    // plane, in which case the list must be rebuilt instead.
+    template <typename Things>
+    bool refit(const Things& things)
+    {
+        for (auto& eq : planes_) {
+            const plane* p = detail::as_plane(things[eq.index]);
+            if (!p) {
+                return false;
+            }
+            eq.norm = p->norm;
+            eq.offset = p->offset;
+        }
+        return true;
+    }
+
+    std::size_t size() const { return planes_.size() + others_.size(); }
+
+    bool empty() const { return size() == 0; }
+
+    std::size_t get_memory_size() const
+    {
+        return planes_.size() * sizeof(plane_eq) + others_.size() * sizeof(std::uint32_t);
+    }
+
+    // Makes the closest of the unbounded things hit by the ray before
+    // closest_dist the closest hit (see test_closer())
+    template <typename Things>
+    void intersect(const ray& ray_, const Things& things, intersection& closest, real_t& closest_dist) const
+    {
+        // As plane::intersect(), but without the variant dispatch, and
+        // dividing only for rays which pass the sign checks. Only an
+        // any_thing can be a plane.
+        if constexpr (std::is_same_v<std::decay_t<decltype(things[0])>, any_thing>) {
+            for (const auto& eq : planes_) {
+                const real_t speed = -dot(eq.norm, ray_.dir);
+                const real_t height = dot(eq.norm, ray_.start) + eq.offset;
+                if (speed <= 0 || height < 0) {
+                    continue;
+                }
+                if (const real_t dist = height / speed; dist < closest_dist) {
+                    closest_dist = dist;
+                    closest = {&things[eq.index], nullptr, dist};
+                }
+            }
+        }
+        for (const auto idx : others_) {
+            detail::test_closer(things[idx], ray_, closest, closest_dist);
+        }
+    }
+
+private:
+    struct plane_eq {
+        vec3 norm;
+        real_t offset;
+        std::uint32_t index;
+    };
+
+    std::pmr::vector<plane_eq> planes_;
+    std::pmr::vector<std::uint32_t> others_;
+};
+
+// How a bvh is built, trading build time against the speed of tracing rays
+// through the result
+struct bvh_build_options {
+    // Up to this many threads build separate subtrees, and share the work of
+    // splitting the nodes near the top of the tree. The tree is the same
+    // whatever the number of threads.
+    int thread_count = int(std::thread::hardware_concurrency());
+    // The number of levels at the top of the tree which are split in half
+    // along a Morton curve through the things' centres, as in an LBVH,
+    // rather than by the SAH. A Morton split costs next to nothing once the
+    // things are sorted, but leaves a tree which is slower to trace.
+    int morton_levels = 0;
+};
+
+// A binary BVH over the bounded things of a scene, built using the surface
+// area heuristic (SAH). Things without bounds (i.e. planes) are kept in a
+// separate list and tested against every ray.
+//
+// The BVH stores indices into the scene's list of things rather than the
+// things themselves, so after things move it can be refitted in O(N) with
+// refit() instead of being rebuilt. Refitting keeps the tree topology, so
+// the tree's quality degrades as things move further from where they were
+// at build time; update() refits, and then rebuilds if the SAH cost has grown
+// past a threshold.
+//
+// Large trees are built in parallel (see bvh_build_options): subtrees are
+// handed to threads of their own, and the binning of the nodes near the top,
+// before there are enough subtrees to go round, is split between threads.
+class bvh {
+public:
+    struct node {
+        aabb bounds;
+        // For leaves, the index of the first primitive; for interior nodes,
+        // the index of the left child (the right child follows it)
+        std::uint32_t left_first;
+        std::uint32_t count; // zero for interior nodes
+
+        bool is_leaf() const { return count != 0; }
+    };
+
+    // Leaves hold at most this many primitives
+    static constexpr std::uint32_t max_leaf_size = 4;
+
+    // The nodes and index lists are allocated from mr, which must outlive
+    // the BVH; the per-thing bounds used while building always come from the
+    // heap, since they are freed as soon as the build finishes.
+    explicit bvh(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : nodes_(mr),
+              prims_(mr),
+              unbounded_(mr)
+    {}
+
+    template <typename Things>
+    explicit bvh(const Things& things,
+                 std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : bvh(mr)
+    {
+        build(things);
+    }
+
+    template <typename Things>
+    void build(const Things& things)
+    {
+        nodes_.clear();
+        prims_.clear();
+        unbounded_.clear();
+        prim_bounds_.clear();
+
+        for (std::uint32_t i = 0; i < things.size(); i++) {
+            if (const auto bounds = things[i].get_bounds()) {
+                prims_.push_back(i);
+                prim_bounds_.push_back(*bounds);
+            } else {
+                unbounded_.add(i, things[i]);
+            }
+        }
+
+        if (!prims_.empty()) {
+            // Small trees aren't worth starting threads for
+            build_state state{int(std::min<std::size_t>(std::size_t(std::max(options_.thread_count, 1)),
+                                                        prims_.size() / min_parallel_count + 1))};
+            if (options_.morton_levels > 0) {
+                sort_by_morton_code(state.thread_count);
+            }
+            // A binary tree with at least one primitive in each leaf has at
+            // most 2N - 1 nodes
+            nodes_.resize(2 * prims_.size() - 1);
+            nodes_[0] = node{aabb::empty(), 0, std::uint32_t(prims_.size())};
+            subdivide(0, 0, state);
+            nodes_.resize(state.next_node);
+        }
+        prim_bounds_.clear();
+        prim_bounds_.shrink_to_fit();
+        morton_codes_.clear();
+        morton_codes_.shrink_to_fit();
+
+        build_cost_ = sah_cost();
+    }
+
+    // Sets how the tree is built from now on; it is not rebuilt until the
+    // next call to build() or update()
+    void set_build_options(const bvh_build_options& options) { options_ = options; }
+
+    const bvh_build_options& get_build_options() const { return options_; }
+
+    // Recomputes every node's bounds from the current positions of the
+    // things, without changing the tree topology. Returns false if a thing
+    // has become unbounded, or an unbounded plane has become something else,
+    // in which case the tree must be rebuilt instead.
+    template <typename Things>
+    bool refit(const Things& things)
+    {
+        if (!unbounded_.refit(things)) {
+            return false;
+        }
+        // Children are always stored after their parents, so a reverse
+        // sweep visits every child before its parent
+        for (auto i = nodes_.size(); i-- > 0;) {
+            node& n = nodes_[i];
+            aabb bounds = aabb::empty();
+            if (n.is_leaf()) {
+                for (std::uint32_t p = n.left_first; p < n.left_first + n.count; p++) {
+                    const auto b = things[prims_[p]].get_bounds();
+                    if (!b) {
+                        return false;
+                    }
+                    bounds.expand(*b);
+                }
+            } else {
+                bounds = nodes_[n.left_first].bounds;
+                bounds.expand(nodes_[n.left_first + 1].bounds);
+            }
+            n.bounds = bounds;
+        }
+        return true;
+    }
+
+    // Refits the tree after things have moved, and rebuilds it instead if
+    // the refitted tree's SAH cost exceeds rebuild_threshold times its cost
+    // when it was built. Returns true if the tree was rebuilt.
+    template <typename Things>
+    bool update(const Things& things, real_t rebuild_threshold = 1.5)
+    {
+        if (!refit(things) || sah_cost() > rebuild_threshold * build_cost_) {
+            build(things);
+            return true;
+        }
+        return false;
+    }
+
+    // The expected cost of tracing a ray through the tree, in units of one
+    // primitive intersection test, relative to the root's surface area
+    real_t sah_cost() const
+    {
+        if (nodes_.empty()) {
+            return 0;
+        }
+        const real_t root_area = nodes_[0].bounds.surface_area();
+        if (root_area <= 0) {
+            return real_t(nodes_[0].count);
+        }
+        real_t cost = 0;
+        for (const node& n : nodes_) {
+            const real_t k = n.is_leaf() ? isect_cost * n.count : traversal_cost;
+            cost += k * n.bounds.surface_area() / root_area;
+        }
+        return cost;
+    }
+
+    real_t get_build_cost() const { return build_cost_; }
+
+    const std::pmr::vector<node>& get_nodes() const { return nodes_; }
+
+    // The indices of the bounded things, in the order the leaves refer to them
+    const std::pmr::vector<std::uint32_t>& get_prims() const { return prims_; }
+
+    const unbounded_list& get_unbounded() const { return unbounded_; }
+
+    // The number of bytes taken by the nodes and index lists
+    std::size_t get_memory_size() const
+    {
+        return nodes_.size() * sizeof(node) + prims_.size() * sizeof(std::uint32_t) + unbounded_.get_memory_size();
+    }
+
+    // Finds the closest of the things hit by the ray before max_dist (see
+    // test_closer()), e.g. to look only for hits nearer than one already
+    // found in another structure
+    template <typename Things>
+    intersection intersect(const ray& ray_, const Things& things, real_t max_dist = no_hit) const
+    {
+        intersection closest{};
+        // Kept apart from closest so that it can stay in a register
+        real_t closest_dist = max_dist;
+
+        const auto test = [&](std::uint32_t idx) { detail::test_closer(things[idx], ray_, closest, closest_dist); };
+
+        unbounded_.intersect(ray_, things, closest, closest_dist);
+
+        if (nodes_.empty()) {
+            return closest;
+        }
+
+        const vec3 inv_dir{real_t{1} / ray_.dir.x, real_t{1} / ray_.dir.y, real_t{1} / ray_.dir.z};
+        // Nodes are pushed along with their entry distance, so that they can
+        // be skipped if a closer hit has been found by the time they're popped
+        std::uint32_t stack[max_stack_size];
+        real_t stack_dist[max_stack_size];
+        int stack_size = 0;
+
+        if (const real_t t = hit_box(nodes_[0].bounds, ray_.start, inv_dir, closest_dist); t < no_hit) {
+            stack[stack_size] = 0;
+            stack_dist[stack_size++] = t;
+        }
+
+        while (stack_size > 0) {
+            --stack_size;
+            if (stack_dist[stack_size] >= closest_dist) {
+                continue;
+            }
+            const node& n = nodes_[stack[stack_size]];
+            if (n.is_leaf()) {
+                for (std::uint32_t p = n.left_first; p < n.left_first + n.count; p++) {
+                    test(prims_[p]);
+                }
+                continue;
+            }
+
+            // Visit the nearer child first, pushing it last
+            std::uint32_t near_idx = n.left_first;
+            std::uint32_t far_idx = n.left_first + 1;
+            real_t near_t = hit_box(nodes_[near_idx].bounds, ray_.start, inv_dir, closest_dist);
+            real_t far_t = hit_box(nodes_[far_idx].bounds, ray_.start, inv_dir, closest_dist);
+            if (far_t < near_t) {
+                std::swap(near_idx, far_idx);
+                std::swap(near_t, far_t);
+            }
+            if (far_t < no_hit) {
+                stack[stack_size] = far_idx;
+                stack_dist[stack_size++] = far_t;
+            }
+            if (near_t < no_hit) {
+                stack[stack_size] = near_idx;
+                stack_dist[stack_size++] = near_t;
+            }
+        }
+
+        return closest;
+    }
+
+private:
+    static constexpr real_t traversal_cost = 1.0;
+    static constexpr real_t isect_cost = 1.0;
+    static constexpr int n_bins = 16;
+    // Below this depth only median splits are made, so that the depth of the
+    // tree (and so the traversal stack) is bounded by 32 + log2(N)
+    static constexpr int max_sah_depth = 32;
+    static constexpr int max_stack_size = 96;
+    // Nodes with fewer primitives than this are always split on one thread
+    static constexpr std::uint32_t min_parallel_count = 4096;
+
+    // Slab test, returning the entry distance if the ray hits the box before
+    // max_dist, or no_hit otherwise. The entry distance may be negative if the
+    // ray starts inside the box.
+    static real_t hit_box(const aabb& box, const vec3& start, const vec3& inv_dir, real_t max_dist)
+    {
+        const real_t tx1 = (box.lower.x - start.x) * inv_dir.x;
+        const real_t tx2 = (box.upper.x - start.x) * inv_dir.x;
+        real_t tmin = std::min(tx1, tx2);
+        real_t tmax = std::max(tx1, tx2);
+        const real_t ty1 = (box.lower.y - start.y) * inv_dir.y;
+        const real_t ty2 = (box.upper.y - start.y) * inv_dir.y;
+        tmin = std::max(tmin, std::min(ty1, ty2));
+        tmax = std::min(tmax, std::max(ty1, ty2));
+        const real_t tz1 = (box.lower.z - start.z) * inv_dir.z;
+        const real_t tz2 = (box.upper.z - start.z) * inv_dir.z;
+        tmin = std::max(tmin, std::min(tz1, tz2));
+        tmax = std::min(tmax, std::max(tz1, tz2));
+        return (tmax >= tmin && tmax >= 0 && tmin < max_dist) ? tmin : no_hit;
+    }
+
+    static real_t axis(const vec3& v, int a)
+    {
+        return a == 0 ? v.x : a == 1 ? v.y : v.z;
+    }
+
+    struct build_state {
+        explicit build_state(int threads)
+                : thread_count{threads}
+        {}
+
+        int thread_count;
+        std::atomic<std::uint32_t> next_node{1};
+    };
+
+    struct bin {
+        aabb bounds = aabb::empty();
+        std::uint32_t count = 0;
+    };
+
+    using bin_set = std::array<std::array<bin, n_bins>, 3>;
+
+    // Splits [0, count) into up to thread_count chunks (see parallel_chunks())
+    // and calls accumulate(acc, begin, end) for each, with an accumulator of
+    // its own starting from init, then combines the accumulators in order
+    // with merge(acc, other). A single chunk is handled without allocating.
+    template <typename T, typename Accumulate, typename Merge>
+    static T reduce_chunks(int thread_count, std::size_t count, const T& init, Accumulate&& accumulate,
+                           Merge&& merge)
+    {
+        if (thread_count <= 1 || count <= 1) {
+            T acc = init;
+            accumulate(acc, 0, count);
+            return acc;
+        }
+        std::vector<T> accs(std::min(std::size_t(thread_count), count), init);
+        detail::parallel_chunks(thread_count, count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            accumulate(accs[chunk], begin, end);
+        });
+        T result = accs[0];
+        for (std::size_t c = 1; c < accs.size(); c++) {
+            merge(result, accs[c]);
+        }
+        return result;
+    }
+
+    // Sorts the primitives along a Morton curve through their centres, with
+    // a radix sort on 30-bit codes
+    void sort_by_morton_code(int thread_count)
+    {
+        const std::size_t count = prims_.size();
+        aabb centroid_bounds = aabb::empty();
+        for (const aabb& b : prim_bounds_) {
+            centroid_bounds.expand(b.centre());
+        }
+        const vec3 extent = centroid_bounds.upper - centroid_bounds.lower;
+        const vec3 scale{extent.x > 0 ? real_t{1023} / extent.x : 0, extent.y > 0 ? real_t{1023} / extent.y : 0,
+                         extent.z > 0 ? real_t{1023} / extent.z : 0};
+
+        std::vector<std::uint32_t> codes(count);
+        detail::parallel_chunks(thread_count, count, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                const vec3 c = prim_bounds_[i].centre() - centroid_bounds.lower;
+                codes[i] = interleave_bits(std::uint32_t(c.x * scale.x)) << 2 |
+                           interleave_bits(std::uint32_t(c.y * scale.y)) << 1 |
+                           interleave_bits(std::uint32_t(c.z * scale.z));
+            }
+        });
+
+        // Three stable passes of 10 bits each, carrying each primitive's
+        // position in the original order along with its code
+        std::vector<std::uint32_t> order(count);
+        std::vector<std::uint32_t> order_tmp(count);
+        std::vector<std::uint32_t> codes_tmp(count);
+        for (std::uint32_t i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        for (int shift = 0; shift < 30; shift += 10) {
+            std::uint32_t offsets[1025] = {};
+            for (const std::uint32_t c : codes) {
+                offsets[((c >> shift) & 1023) + 1]++;
+            }
+            for (int d = 0; d < 1024; d++) {
+                offsets[d + 1] += offsets[d];
+            }
+            for (std::size_t i = 0; i < count; i++) {
+                const std::uint32_t dest = offsets[(codes[i] >> shift) & 1023]++;
+                codes_tmp[dest] = codes[i];
+                order_tmp[dest] = order[i];
+            }
+            codes.swap(codes_tmp);
+            order.swap(order_tmp);
+        }
+
+        std::vector<aabb> bounds(count);
+        for (std::size_t i = 0; i < count; i++) {
+            order_tmp[i] = prims_[order[i]];
+            bounds[i] = prim_bounds_[order[i]];
+        }
+        std::copy(order_tmp.begin(), order_tmp.end(), prims_.begin());
+        prim_bounds_.swap(bounds);
+        morton_codes_.swap(codes);
+    }
+
+    // Spreads the low 10 bits of v out to every third bit
+    static std::uint32_t interleave_bits(std::uint32_t v)
+    {
+        v = std::min(v, 1023u);
+        v = (v | (v << 16)) & 0x030000ffu;
+        v = (v | (v << 8)) & 0x0300f00fu;
+        v = (v | (v << 4)) & 0x030c30c3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        return v;
+    }
+
+    // Returns the index at which the (sorted) Morton codes of the given
+    // primitives first differ in their highest differing bit, or the middle
+    // if their codes are all the same
+    std::uint32_t morton_split(std::uint32_t first, std::uint32_t count) const
+    {
+        const std::uint32_t first_code = morton_codes_[first];
+        const std::uint32_t diff = first_code ^ morton_codes_[first + count - 1];
+        if (diff == 0) {
+            return first + count / 2;
+        }
+        std::uint32_t bit = 1u << 31;
+        while (!(diff & bit)) {
+            bit >>= 1;
+        }
+        const auto it = std::partition_point(morton_codes_.begin() + first, morton_codes_.begin() + first + count,
+                                             [bit](std::uint32_t c) { return !(c & bit); });
+        return std::uint32_t(it - morton_codes_.begin());
+    }
+
+    void subdivide(std::uint32_t node_idx, int depth, build_state& state)
+    {
+        const std::uint32_t first = nodes_[node_idx].left_first;
+        const std::uint32_t count = nodes_[node_idx].count;
+
+        // Nodes near the top of the tree are split with the help of the
+        // threads which will later be building their subtrees. The tree can
+        // be deeper than an int has bits, so the shift is guarded.
+        const int threads = count >= min_parallel_count && depth < 31 ? std::max(state.thread_count >> depth, 1)
+                                                                      : 1;
+
+        const auto [bounds, centroid_bounds] = reduce_chunks(
+                threads, count, std::pair{aabb::empty(), aabb::empty()},
+                [&](std::pair<aabb, aabb>& acc, std::size_t begin, std::size_t end) {
+                    for (std::size_t p = first + begin; p < first + end; p++) {
+                        acc.first.expand(prim_bounds_[p]);
+                        acc.second.expand(prim_bounds_[p].centre());
+                    }
+                },
+                [](std::pair<aabb, aabb>& acc, const std::pair<aabb, aabb>& other) {
+                    acc.first.expand(other.first);
+                    acc.second.expand(other.second);
+                });
+        nodes_[node_idx].bounds = bounds;
+
+        if (count <= 1) {
+            return;
+        }
+
+        std::uint32_t mid;
+        if (depth < options_.morton_levels) {
+            mid = morton_split(first, count);
+        } else {
+            const auto best = find_sah_split(first, count, bounds, centroid_bounds, threads);
+            int best_axis = best.axis;
+
+            // If splitting doesn't pay according to the SAH (or all the
+            // centroids coincide) but the leaf would be too big, or if the
+            // tree is getting too deep for the traversal stack, split down
+            // the middle instead
+            if (best_axis < 0 && count <= max_leaf_size) {
+                return;
+            }
+            if (depth >= max_sah_depth) {
+                best_axis = -1;
+            }
+
+            if (best_axis >= 0) {
+                const real_t lo = axis(centroid_bounds.lower, best_axis);
+                const real_t scale = n_bins / (axis(centroid_bounds.upper, best_axis) - lo);
+                const auto in_left = [&](std::uint32_t p) {
+                    return std::min(n_bins - 1, int((axis(prim_bounds_[p].centre(), best_axis) - lo) * scale)) <= best.split;
+                };
+                std::uint32_t i = first;
+                std::uint32_t j = first + count;
+                while (i < j) {
+                    if (in_left(i)) {
+                        i++;
+                    } else {
+                        j--;
+                        std::swap(prims_[i], prims_[j]);
+                        std::swap(prim_bounds_[i], prim_bounds_[j]);
+                    }
+                }
+                mid = i;
+            } else {
+                mid = first + count / 2;
+            }
+        }
+
+        const std::uint32_t left_idx = state.next_node.fetch_add(2, std::memory_order_relaxed);
+        nodes_[left_idx] = node{aabb::empty(), first, mid - first};
+        nodes_[left_idx + 1] = node{aabb::empty(), mid, first + count - mid};
+        nodes_[node_idx].left_first = left_idx;
+        nodes_[node_idx].count = 0;
+
+        // Hand the left subtree to another thread while there are threads
+        // to spare, i.e. until there are as many subtrees as threads
+        if (count >= min_parallel_count && depth < 30 && (2 << depth) <= state.thread_count) {
+            std::thread left{[&] { subdivide(left_idx, depth + 1, state); }};
+            subdivide(left_idx + 1, depth + 1, state);
+            left.join();
+        } else {
+            subdivide(left_idx, depth + 1, state);
+            subdivide(left_idx + 1, depth + 1, state);
+        }
+    }
+
+    struct sah_split {
+        int axis = -1;
+        int split = 0;
+    };
+
+    // Finds the best binned SAH split over all three axes, or returns an
+    // axis of -1 if no split is cheaper than a leaf
+    sah_split find_sah_split(std::uint32_t first, std::uint32_t count, const aabb& bounds,
+                             const aabb& centroid_bounds, int threads) const
+    {
+        real_t lo[3];
+        real_t scale[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = axis(centroid_bounds.lower, a);
+            const real_t extent = axis(centroid_bounds.upper, a) - lo[a];
+            scale[a] = extent > 0 ? n_bins / extent : 0;
+        }
+
+        const bin_set bins = reduce_chunks(
+                threads, count, bin_set{},
+                [&](bin_set& acc, std::size_t begin, std::size_t end) {
+                    for (std::size_t p = first + begin; p < first + end; p++) {
+                        const vec3 centre = prim_bounds_[p].centre();
+                        for (int a = 0; a < 3; a++) {
+                            const int b = std::min(n_bins - 1, int((axis(centre, a) - lo[a]) * scale[a]));
+                            acc[a][b].count++;
+                            acc[a][b].bounds.expand(prim_bounds_[p]);
+                        }
+                    }
+                },
+                [](bin_set& acc, const bin_set& other) {
+                    for (int a = 0; a < 3; a++) {
+                        for (int b = 0; b < n_bins; b++) {
+                            acc[a][b].count += other[a][b].count;
+                            acc[a][b].bounds.expand(other[a][b].bounds);
+                        }
+                    }
+                });
+
+        sah_split best{};
+        real_t best_cost = isect_cost * count * bounds.surface_area();
+        for (int a = 0; a < 3; a++) {
+            if (scale[a] == 0) {
+                continue;
+            }
+
+            // Sweep from the right to find the cost of each right-hand side,
+            // then from the left to evaluate each split
+            real_t right_area[n_bins - 1];
+            std::uint32_t right_count[n_bins - 1];
+            aabb acc = aabb::empty();
+            std::uint32_t n = 0;
+            for (int b = n_bins - 1; b > 0; b--) {
+                acc.expand(bins[a][b].bounds);
+                n += bins[a][b].count;
+                right_area[b - 1] = acc.surface_area();
+                right_count[b - 1] = n;
+            }
+            acc = aabb::empty();
+            n = 0;
+            for (int b = 0; b < n_bins - 1; b++) {
+                acc.expand(bins[a][b].bounds);
+                n += bins[a][b].count;
+                if (n == 0 || right_count[b] == 0) {
+                    continue;
+                }
+                const real_t cost = traversal_cost * bounds.surface_area() +
+                        isect_cost * (n * acc.surface_area() + right_count[b] * right_area[b]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = {a, b};
+                }
+            }
+        }
+        return best;
+    }
+
+    std::pmr::vector<node> nodes_;
+    std::pmr::vector<std::uint32_t> prims_;     // indices of bounded things
+    unbounded_list unbounded_;
+    std::vector<aabb> prim_bounds_;             // only used during build
+    std::vector<std::uint32_t> morton_codes_;   // only used during build, and only with Morton levels
+    real_t build_cost_ = 0;
+    bvh_build_options options_{};
+};
+
+} // end namespace rt
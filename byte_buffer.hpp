@@ -0,0 +1,190 @@
+
+/*
+ * Little-endian binary encoding, for file formats and the wire protocol
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace rt {
+
+// The 64-bit FNV-1a hash of a run of bytes
+inline std::uint64_t fnv1a_hash(const std::uint8_t* data, std::size_t size)
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+namespace detail {
+
+// Appends little-endian values to a byte buffer
+struct byte_buffer {
+    std::vector<std::uint8_t> bytes;
+
+    void put_u8(std::uint8_t v) { bytes.push_back(v); }
+
+    void put_u16(std::uint16_t v)
+    {
+        put_u8(std::uint8_t(v));
+        put_u8(std::uint8_t(v >> 8));
+    }
+
+    void put_u32(std::uint32_t v)
+    {
+        put_u16(std::uint16_t(v));
+        put_u16(std::uint16_t(v >> 16));
+    }
+
+    void put_u64(std::uint64_t v)
+    {
+        put_u32(std::uint32_t(v));
+        put_u32(std::uint32_t(v >> 32));
+    }
+
+    void put_f32(float v)
+    {
+        std::uint32_t u;
+        std::memcpy(&u, &v, sizeof(u));
+        put_u32(u);
+    }
+
+    void put_f64(double v)
+    {
+        std::uint64_t u;
+        std::memcpy(&u, &v, sizeof(u));
+        put_u64(u);
+    }
+
+    void put_str(const char* s) { bytes.insert(bytes.end(), s, s + std::strlen(s) + 1); }
+
+    void put_bytes(const std::uint8_t* data, std::size_t size) { bytes.insert(bytes.end(), data, data + size); }
+
+    void write(std::FILE* out) const { std::fwrite(bytes.data(), 1, bytes.size(), out); }
+};
+
+// Reads back values written by a byte_buffer. Reading past the end of the
+// data returns zeros and marks the reader as failed, so that a whole message
+// can be decoded and then checked once with ok().
+class byte_reader {
+public:
+    byte_reader(const std::uint8_t* data, std::size_t size)
+            : data_{data},
+              size_{size}
+    {}
+
+    explicit byte_reader(const std::vector<std::uint8_t>& bytes)
+            : byte_reader(bytes.data(), bytes.size())
+    {}
+
+    std::uint8_t get_u8()
+    {
+        const std::uint8_t* p = get_bytes(1);
+        return p ? *p : 0;
+    }
+
+    std::uint16_t get_u16()
+    {
+        const std::uint16_t lo = get_u8();
+        return std::uint16_t(lo | (get_u8() << 8));
+    }
+
+    std::uint32_t get_u32()
+    {
+        const std::uint32_t lo = get_u16();
+        return lo | (std::uint32_t(get_u16()) << 16);
+    }
+
+    std::uint64_t get_u64()
+    {
+        const std::uint64_t lo = get_u32();
+        return lo | (std::uint64_t(get_u32()) << 32);
+    }
+
+    float get_f32()
+    {
+        const std::uint32_t u = get_u32();
+        float v;
+        std::memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+
+    double get_f64()
+    {
+        const std::uint64_t u = get_u64();
+        double v;
+        std::memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+
+    std::string get_str()
+    {
+        const auto* end = static_cast<const std::uint8_t*>(std::memchr(data_ + pos_, 0, size_ - pos_));
+        if (!end) {
+            failed_ = true;
+            pos_ = size_;
+            return {};
+        }
+        std::string s(reinterpret_cast<const char*>(data_ + pos_), std::size_t(end - (data_ + pos_)));
+        pos_ += s.size() + 1;
+        return s;
+    }
+
+    // Returns a pointer to the next size bytes, or nullptr if there aren't
+    // that many left
+    const std::uint8_t* get_bytes(std::size_t size)
+    {
+        if (size > size_ - pos_) {
+            failed_ = true;
+            pos_ = size_;
+            return nullptr;
+        }
+        const std::uint8_t* p = data_ + pos_;
+        pos_ += size;
+        return p;
+    }
+
+    std::size_t get_remaining() const { return size_ - pos_; }
+
+    bool ok() const { return !failed_; }
+
+private:
+    const std::uint8_t* data_;
+    std::size_t size_;
+    std::size_t pos_ = 0;
+    bool failed_ = false;
+};
+
+// A stbi_write_func which appends the data to the std::vector<std::uint8_t>
+// passed as its context
+inline void append_to_vector(void* context, void* data, int size)
+{
+    auto* out = static_cast<std::vector<std::uint8_t>*>(context);
+    const auto* bytes = static_cast<const std::uint8_t*>(data);
+    out->insert(out->end(), bytes, bytes + size);
+}
+
+} // end namespace detail
+} // end namespace rt
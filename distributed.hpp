@@ -0,0 +1,224 @@
+
+/*
+ * Rendering a frame across several worker processes
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "byte_buffer.hpp"
+#include "render_daemon.hpp"
+#include "render_protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rt {
+
+struct distributed_options {
+    int tile_size = 32;
+    int max_depth = 5;
+    // The number of tiles each worker is sent ahead of the one it is working
+    // on, so that it isn't left idle while results travel back
+    int tiles_in_flight = 2;
+    // A worker which sends nothing for this long is assumed to have stalled
+    std::chrono::milliseconds stall_timeout{10000};
+};
+
+struct distributed_stats {
+    int tiles = 0;
+    // The number of tiles sent to another worker after the first one they
+    // were sent to stalled or crashed
+    int reissued = 0;
+    // The number of tiles each worker rendered (or at least, returned first)
+    std::vector<int> tiles_per_worker;
+    // Why each worker which was given up on was lost, or empty for workers
+    // which lasted to the end
+    std::vector<std::string> errors;
+};
+
+// Renders the scene onto the canvas, using render_daemons at the given
+// addresses (see connect_to()) as workers. Workers may be processes on this
+// host or on others.
+//
+// The scene is encoded once and uploaded to each worker, and then the image
+// is split into tiles, which are handed out to the workers as they finish
+// earlier ones. A worker whose connection fails, or which sends nothing for
+// the stall timeout, is dropped, and the tiles it hadn't returned are
+// reissued to the others; if the same tile later arrives twice, the first
+// copy is kept. Tiles come back as linear float colours and are written with
+// canvas.set_pixel(), so the canvas sees the same colours as it would in a
+// local render.
+//
+// Returns false if every worker was lost before the image was finished, in
+// which case the missing tiles are left as they were.
+template <typename Scene, typename Canvas>
+bool render_distributed(const Scene& scene, Canvas& canvas, int width, int height,
+                        const std::vector<std::string>& workers,
+                        const distributed_options& opts = {}, distributed_stats* stats = nullptr)
+{
+    const auto scene_bytes = encode_scene(scene);
+    if (!scene_bytes) {
+        return false;
+    }
+
+    std::vector<tile> tiles;
+    for (int y = 0; y < height; y += opts.tile_size) {
+        for (int x = 0; x < width; x += opts.tile_size) {
+            tiles.push_back({x, y, std::min(opts.tile_size, width - x), std::min(opts.tile_size, height - y)});
+        }
+    }
+
+    // Everything below is guarded by the mutex, including the canvas
+    std::mutex mutex;
+    std::condition_variable work_changed;
+    std::deque<std::uint32_t> queue;
+    for (std::uint32_t i = 0; i < tiles.size(); i++) {
+        queue.push_back(i);
+    }
+    std::vector<bool> done(tiles.size());
+    std::size_t remaining = tiles.size();
+    distributed_stats st{int(tiles.size()), 0, std::vector<int>(workers.size()),
+                         std::vector<std::string>(workers.size())};
+
+    // Writes a tile to the canvas, unless another copy of it has already
+    // arrived. Called with the mutex held.
+    const auto accept_tile = [&](const tile_message& msg, std::size_t worker) {
+        if (msg.job_id >= tiles.size() || done[msg.job_id] || msg.encoding != tile_encoding::rgb32f) {
+            return;
+        }
+        const tile& t = tiles[msg.job_id];
+        detail::byte_reader in{msg.data};
+        if (in.get_remaining() != std::size_t(t.width) * t.height * 12) {
+            return;
+        }
+        for (int y = t.y; y < t.y + t.height; y++) {
+            for (int x = t.x; x < t.x + t.width; x++) {
+                const real_t r = real_t(in.get_f32());
+                const real_t g = real_t(in.get_f32());
+                canvas.set_pixel(x, y, color{r, g, real_t(in.get_f32())});
+            }
+        }
+        done[msg.job_id] = true;
+        st.tiles_per_worker[worker]++;
+        if (--remaining == 0) {
+            work_changed.notify_all();
+        }
+    };
+
+    const auto run_worker = [&](std::size_t w) {
+        std::vector<std::uint32_t> in_flight;
+        render_client client;
+        std::optional<std::uint64_t> scene_id;
+        if (client.connect(workers[w].c_str())) {
+            client.set_timeout(opts.stall_timeout);
+            scene_id = client.upload_scene(*scene_bytes);
+        }
+
+        bool ok = scene_id.has_value();
+        render_request req{};
+        req.scene_id = scene_id.value_or(0);
+        req.cam = scene.get_camera();
+        req.width = width;
+        req.height = height;
+        req.max_depth = opts.max_depth;
+        req.tile_size = opts.tile_size;
+        req.encoding = tile_encoding::rgb32f;
+
+        while (ok) {
+            std::vector<std::uint32_t> to_send;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                if (in_flight.empty()) {
+                    work_changed.wait(lock, [&] { return remaining == 0 || !queue.empty(); });
+                }
+                if (remaining == 0) {
+                    break;
+                }
+                while (!queue.empty() && in_flight.size() + to_send.size() < std::size_t(opts.tiles_in_flight)) {
+                    if (!done[queue.front()]) {
+                        to_send.push_back(queue.front());
+                    }
+                    queue.pop_front();
+                }
+            }
+
+            // Each tile is sent as a job of its own, with the tile's index
+            // as its id
+            for (const std::uint32_t i : to_send) {
+                req.job_id = i;
+                req.region = tiles[i];
+                if (!client.submit(req)) {
+                    ok = false;
+                    break;
+                }
+                in_flight.push_back(i);
+            }
+            if (!ok || in_flight.empty()) {
+                continue;
+            }
+
+            const auto finished = client.wait_for_job([&](const tile_message& msg) {
+                std::lock_guard<std::mutex> lock{mutex};
+                accept_tile(msg, w);
+            });
+            if (!finished) {
+                ok = false;
+            } else {
+                in_flight.erase(std::remove(in_flight.begin(), in_flight.end(), *finished), in_flight.end());
+            }
+        }
+
+        // Give back whatever this worker hadn't finished. A worker which got
+        // this far with ok set has finished, and only leaves duplicates.
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!ok) {
+            st.errors[w] = client.get_error();
+        }
+        for (auto it = in_flight.rbegin(); it != in_flight.rend(); ++it) {
+            if (!done[*it]) {
+                queue.push_front(*it);
+                st.reissued++;
+            }
+        }
+        work_changed.notify_all();
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t w = 0; w < workers.size(); w++) {
+        threads.emplace_back(run_worker, w);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (stats) {
+        *stats = std::move(st);
+    }
+    return remaining == 0;
+}
+
+} // end namespace rt
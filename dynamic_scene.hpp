@@ -0,0 +1,362 @@
+
+/*
+ * Run-time scene and canvas types, using std::vector for storage
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "arena.hpp"
+#include "bvh.hpp"
+#include "grid.hpp"
+#include "light_tree.hpp"
+#include "quantise.hpp"
+#include "wide_bvh.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+namespace rt {
+
+// The structure a dynamic_scene uses to find the things hit by a ray
+enum class spatial_index {
+    // The binary BVH, which the wide BVHs are collapsed from
+    bvh,
+    grid,
+    // A 4-wide compressed_bvh
+    compressed_bvh,
+    // An 8-wide wide_bvh, the default
+    wide_bvh
+};
+
+// The things, lights and acceleration structures of a dynamic_scene are all
+// allocated from an arena owned by the scene, so they sit together in a few
+// large blocks and are freed in one go. The arena never reuses memory, so
+// rebuilding the BVH or light tree with a different number of things or
+// lights grows it; refits, and rebuilds of the same size, do not. Rebuilding
+// the grid can grow it too, since its size depends on where the things are.
+struct dynamic_scene {
+    dynamic_scene()
+            : cam_{vec3{ 3.0, 2.0, 4.0 }, vec3{ -1.0, 0.5, 0.0 }}
+    {
+        things_.push_back(plane{vec3{ 0.0, 1.0, 0.0 }, 0.0, surfaces::checkerboard});
+        things_.push_back(sphere{vec3{ 0.0, 1.0, -0.25 }, 1.0, surfaces::shiny});
+        things_.push_back(sphere{vec3{ -1.0, 0.5, 1.5 }, 0.5, surfaces::shiny});
+
+        lights_.push_back(light{ {-2.0, 2.5, 0.0}, {0.49, 0.07, 0.07}});
+        lights_.push_back(light{ {1.5, 2.5, 1.5}, {0.07, 0.07, 0.49} });
+        lights_.push_back(light{ {1.5, 2.5, -1.5}, {0.07, 0.49, 0.071} });
+        lights_.push_back(light{ {0.0, 3.5, 0.0}, {0.21, 0.21, 0.35} });
+
+        build_index();
+        light_tree_ = light_tree{lights_, {}, get_resource()};
+    }
+
+    dynamic_scene(const std::vector<any_thing>& things, const std::vector<light>& lights,
+                  const camera& cam)
+            : things_(things.begin(), things.end(), get_resource()),
+              lights_(lights.begin(), lights.end(), get_resource()),
+              cam_{cam},
+              light_tree_{lights_, {}, get_resource()}
+    {
+        build_index();
+    }
+
+    dynamic_scene(dynamic_scene&&) = default;
+
+    // Moves other's contents into this scene's arena, which it keeps. The
+    // containers cannot take over other's memory, since a pmr container
+    // never changes the resource it allocates from, so the contents are
+    // copied across (growing the arena), and other keeps its arena.
+    dynamic_scene& operator=(dynamic_scene&& other)
+    {
+        if (this != &other) {
+            things_ = std::move(other.things_);
+            lights_ = std::move(other.lights_);
+            cam_ = other.cam_;
+            index_ = other.index_;
+            bvh_ = std::move(other.bvh_);
+            grid_ = std::move(other.grid_);
+            compressed_bvh_ = std::move(other.compressed_bvh_);
+            wide_bvh_ = std::move(other.wide_bvh_);
+            light_tree_ = std::move(other.light_tree_);
+        }
+        return *this;
+    }
+
+    // The demo scene, with a field of count small spheres added between the
+    // two large ones, for exercising the acceleration structures
+    static dynamic_scene with_sphere_field(int count, spatial_index index = spatial_index::wide_bvh)
+    {
+        dynamic_scene scene{};
+        const int side = int(std::ceil(std::sqrt(real_t(count))));
+        std::uint32_t seed = 12345;
+        const auto rand01 = [&seed] {
+            seed = seed * 1664525u + 1013904223u;
+            return real_t(seed >> 8) / real_t(1u << 24);
+        };
+        scene.things_.reserve(scene.things_.size() + count);
+        for (int i = 0; i < count; i++) {
+            const real_t x = real_t(-4.0 + 8.0 * ((i % side) + rand01()) / side);
+            const real_t z = real_t(-4.0 + 8.0 * ((i / side) + rand01()) / side);
+            const real_t r = real_t((0.1 + 0.2 * rand01()) * 4.0 / side);
+            const real_t y = r + real_t(1.5) * rand01();
+            scene.things_.push_back(sphere{vec3{x, y, z}, r, surfaces::shiny});
+        }
+        scene.index_ = index;
+        scene.build_index();
+        return scene;
+    }
+
+    // The demo scene, with count equal spheres scattered uniformly through a
+    // box above the plane, for exercising the acceleration structures on a
+    // scene which isn't flat
+    static dynamic_scene with_sphere_volume(int count, spatial_index index = spatial_index::wide_bvh)
+    {
+        dynamic_scene scene{};
+        const real_t r = real_t(0.3 * 4.0 / std::ceil(std::cbrt(real_t(count))));
+        std::uint32_t seed = 23456;
+        const auto rand01 = [&seed] {
+            seed = seed * 1664525u + 1013904223u;
+            return real_t(seed >> 8) / real_t(1u << 24);
+        };
+        scene.things_.reserve(scene.things_.size() + count);
+        for (int i = 0; i < count; i++) {
+            const vec3 centre{real_t(-4.0) + 8 * rand01(), real_t(0.1) + 4 * rand01(), real_t(-4.0) + 8 * rand01()};
+            scene.things_.push_back(sphere{centre, r, surfaces::shiny});
+        }
+        scene.index_ = index;
+        scene.build_index();
+        return scene;
+    }
+
+    // The demo scene, with count small, short-range lights scattered just
+    // above the plane, for exercising the light tree
+    static dynamic_scene with_light_field(int count)
+    {
+        dynamic_scene scene{};
+        std::uint32_t seed = 54321;
+        const auto rand01 = [&seed] {
+            seed = seed * 1664525u + 1013904223u;
+            return real_t(seed >> 8) / real_t(1u << 24);
+        };
+        scene.lights_.reserve(scene.lights_.size() + count);
+        for (int i = 0; i < count; i++) {
+            const vec3 pos{real_t(-4.0) + 8 * rand01(), real_t(0.2) + rand01(), real_t(-4.0) + 8 * rand01()};
+            const color col{real_t(0.2) * rand01(), real_t(0.2) * rand01(), real_t(0.2) * rand01()};
+            scene.lights_.push_back(light{pos, col, real_t(0.5) + rand01()});
+        }
+        scene.light_tree_ = light_tree{scene.lights_, {}, scene.get_resource()};
+        return scene;
+    }
+
+    const auto& get_things() const { return things_; }
+
+    const auto& get_lights() const { return lights_; }
+
+    const auto& get_camera() const { return cam_; }
+
+    const bvh& get_bvh() const { return bvh_; }
+
+    const uniform_grid& get_grid() const { return grid_; }
+
+    const compressed_bvh<4>& get_compressed_bvh() const { return compressed_bvh_; }
+
+    const wide_bvh<8>& get_wide_bvh() const { return wide_bvh_; }
+
+    spatial_index get_spatial_index() const { return index_; }
+
+    // Sets how the BVH is built, and rebuilds it if it is in use. The grid
+    // is built with the same number of threads.
+    void set_bvh_build_options(const bvh_build_options& options)
+    {
+        bvh_.set_build_options(options);
+        if (index_ != spatial_index::grid) {
+            build_index();
+        }
+    }
+
+    // Switches to finding hits using the given structure, building it if
+    // necessary
+    void set_spatial_index(spatial_index index)
+    {
+        if (index != index_) {
+            index_ = index;
+            build_index();
+        }
+    }
+
+    // Builds the spatial index in use from scratch, e.g. to time the build
+    void build_index()
+    {
+        if (index_ == spatial_index::grid) {
+            grid_.build(things_, bvh_.get_build_options().thread_count);
+        } else {
+            bvh_.build(things_);
+            collapse_bvh();
+        }
+    }
+
+    intersection intersect(const ray& ray_) const
+    {
+        switch (index_) {
+        case spatial_index::grid:
+            return grid_.intersect(ray_, things_);
+        case spatial_index::compressed_bvh:
+            return compressed_bvh_.intersect(ray_, things_);
+        case spatial_index::wide_bvh:
+            return wide_bvh_.intersect(ray_, things_);
+        default:
+            return bvh_.intersect(ray_, things_);
+        }
+    }
+
+    // Finds something the ray hits closer than max_dist, for shadow rays.
+    // The wide BVHs stop at the first such hit; the other structures look
+    // for the closest.
+    intersection intersect_any(const ray& ray_, real_t max_dist) const
+    {
+        switch (index_) {
+        case spatial_index::compressed_bvh:
+            return compressed_bvh_.intersect_any(ray_, things_, max_dist);
+        case spatial_index::wide_bvh:
+            return wide_bvh_.intersect_any(ray_, things_, max_dist);
+        default: {
+            const auto isect = intersect(ray_);
+            return isect.dist < max_dist ? isect : intersection{};
+        }
+        }
+    }
+
+    template <typename Func>
+    void for_each_light(const vec3& pos, Func&& func) const
+    {
+        light_tree_.for_each_light(pos, func);
+    }
+
+    void set_light_sampling(const light_sampling& sampling)
+    {
+        light_tree_ = light_tree{lights_, sampling, get_resource()};
+    }
+
+    void set_camera(const camera& cam) { cam_ = cam; }
+
+    // Replaces the thing at index i, e.g. with a moved copy of itself. To
+    // move many things at once, prefer update_things(), which refits the BVH
+    // only once.
+    void set_thing(std::size_t i, const any_thing& thing)
+    {
+        things_[i] = thing;
+        update_index(1.5);
+    }
+
+    // Calls fn(index, thing) for each of the given indices to update the
+    // things in place, then refits the BVH (or rebuilds it, if refitting has
+    // degraded it too much) and collapses it again if a wide BVH is in use,
+    // or rebuilds the grid. Returns true if the spatial index was
+    // rebuilt.
+    template <typename Func>
+    bool update_things(const std::vector<std::size_t>& indices, Func&& fn,
+                       real_t rebuild_threshold = 1.5)
+    {
+        for (const auto i : indices) {
+            fn(i, things_[i]);
+        }
+        return update_index(rebuild_threshold);
+    }
+
+private:
+    std::pmr::memory_resource* get_resource() const { return arena_.get(); }
+
+    bool update_index(real_t rebuild_threshold)
+    {
+        if (index_ == spatial_index::grid) {
+            grid_.build(things_, bvh_.get_build_options().thread_count);
+            return true;
+        }
+        const bool rebuilt = bvh_.update(things_, rebuild_threshold);
+        collapse_bvh();
+        return rebuilt;
+    }
+
+    // Collapses the BVH into the wide BVH in use, if any
+    void collapse_bvh()
+    {
+        if (index_ == spatial_index::compressed_bvh) {
+            compressed_bvh_.build(bvh_);
+        } else if (index_ == spatial_index::wide_bvh) {
+            wide_bvh_.build(bvh_);
+        }
+    }
+
+    // Held by pointer so that the containers' resource stays put when the
+    // scene is move-constructed. (Assigning a scene must not replace it; see
+    // operator=.)
+    std::unique_ptr<arena> arena_ = std::make_unique<arena>();
+    std::pmr::vector<any_thing> things_ = std::pmr::vector<any_thing>(get_resource());
+    std::pmr::vector<light> lights_ = std::pmr::vector<light>(get_resource());
+    camera cam_;
+    spatial_index index_ = spatial_index::wide_bvh;
+    bvh bvh_{get_resource()};
+    uniform_grid grid_{get_resource()};
+    compressed_bvh<4> compressed_bvh_{get_resource()};
+    wide_bvh<8> wide_bvh_{get_resource()};
+    light_tree light_tree_{get_resource()};
+};
+
+struct dynamic_canvas {
+
+    int width;
+    int height;
+    static constexpr int bpp = 4;
+
+    dynamic_canvas(int width, int height)
+            : width{width},
+              height{height},
+              pixels_(width * height)
+    {}
+
+    void set_pixel(int x, int y, const color& col)
+    {
+        set_pixels(x, y, &col, 1);
+    }
+
+    // Sets count pixels of row y, starting from x, in one pass
+    void set_pixels(int x, int y, const color* cols, int count)
+    {
+        quantise_rgba8(cols, reinterpret_cast<std::uint8_t*>(&pixels_[x + width * y]), count, x, y,
+                       options_);
+    }
+
+    void set_quantise_options(const quantise_options& opts) { options_ = opts; }
+
+    const auto& get_pixels() const { return pixels_; }
+
+private:
+    struct rgba {
+        uint8_t r, g, b, a;
+    };
+
+    std::vector<rgba> pixels_;
+    quantise_options options_{};
+};
+
+} // end namespace rt
@@ -0,0 +1,325 @@
+
+/*
+ * Uniform grid for run-time scenes of many evenly spread things
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+namespace rt {
+
+// A uniform grid over the bounded things of a scene, traversed with a 3D-DDA.
+// Like the BVH, it stores indices into the scene's list of things, and keeps
+// things without bounds (i.e. planes) in a separate list which is tested
+// against every ray.
+//
+// For a large number of things of similar size spread evenly through space,
+// such as particles, the grid traces about as quickly as a BVH, but building
+// it takes only a few linear passes (which are split between threads) rather
+// than an O(N log N) sort-like recursion, so it can cheaply be rebuilt every
+// frame. It copes badly with things of very different sizes, or bunched up
+// in a small part of the scene, which the BVH handles well.
+class uniform_grid {
+public:
+    // The cells and index lists are allocated from mr, which must outlive
+    // the grid; the per-thing bounds and cell counters used while building
+    // always come from the heap, since they are freed as soon as the build
+    // finishes.
+    explicit uniform_grid(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : cell_start_(mr),
+              refs_(mr),
+              unbounded_(mr)
+    {}
+
+    template <typename Things>
+    explicit uniform_grid(const Things& things,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : uniform_grid(mr)
+    {
+        build(things);
+    }
+
+    // Builds the grid, using up to thread_count threads. The result does not
+    // depend on the number of threads.
+    template <typename Things>
+    void build(const Things& things, int thread_count = int(std::thread::hardware_concurrency()))
+    {
+        cell_start_.clear();
+        refs_.clear();
+        unbounded_.clear();
+
+        // Small builds aren't worth starting threads for
+        const std::size_t n = things.size();
+        thread_count = int(std::min<std::size_t>(std::size_t(std::max(thread_count, 1)), n / 4096 + 1));
+
+        // Gather the things' bounds, and the bounds of them all
+        std::vector<aabb> prim_bounds(n);
+        std::vector<aabb> chunk_bounds(std::size_t(thread_count), aabb::empty());
+        detail::parallel_chunks(thread_count, n, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                if (const auto b = things[i].get_bounds()) {
+                    prim_bounds[i] = *b;
+                    chunk_bounds[chunk].expand(*b);
+                } else {
+                    prim_bounds[i] = aabb::empty();
+                }
+            }
+        });
+        bounds_ = aabb::empty();
+        for (const aabb& b : chunk_bounds) {
+            bounds_.expand(b);
+        }
+        std::size_t bounded = 0;
+        for (std::uint32_t i = 0; i < n; i++) {
+            if (prim_bounds[i].lower.x > prim_bounds[i].upper.x) {
+                unbounded_.add(i, things[i]);
+            } else {
+                bounded++;
+            }
+        }
+        if (bounded == 0) {
+            return;
+        }
+
+        choose_resolution(bounded);
+        const std::size_t cell_count = std::size_t(res_[0]) * res_[1] * res_[2];
+
+        // Count the things overlapping each cell, then allot each cell its
+        // range of the reference list and fill them in
+        std::unique_ptr<std::atomic<std::uint32_t>[]> counts{new std::atomic<std::uint32_t>[cell_count]()};
+        const auto for_each_cell = [&](const aabb& b, auto&& fn) {
+            const cell_range r = get_cell_range(b);
+            for (int z = r.lower[2]; z <= r.upper[2]; z++) {
+                for (int y = r.lower[1]; y <= r.upper[1]; y++) {
+                    for (int x = r.lower[0]; x <= r.upper[0]; x++) {
+                        fn(x + std::size_t(res_[0]) * (y + std::size_t(res_[1]) * z));
+                    }
+                }
+            }
+        };
+        detail::parallel_chunks(thread_count, n, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                if (prim_bounds[i].lower.x <= prim_bounds[i].upper.x) {
+                    for_each_cell(prim_bounds[i], [&](std::size_t c) { counts[c].fetch_add(1, std::memory_order_relaxed); });
+                }
+            }
+        });
+
+        cell_start_.resize(cell_count + 1);
+        std::uint32_t total = 0;
+        for (std::size_t c = 0; c < cell_count; c++) {
+            cell_start_[c] = total;
+            total += counts[c].load(std::memory_order_relaxed);
+            counts[c].store(cell_start_[c], std::memory_order_relaxed);
+        }
+        cell_start_[cell_count] = total;
+
+        refs_.resize(total);
+        detail::parallel_chunks(thread_count, n, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                if (prim_bounds[i].lower.x <= prim_bounds[i].upper.x) {
+                    for_each_cell(prim_bounds[i], [&](std::size_t c) {
+                        refs_[counts[c].fetch_add(1, std::memory_order_relaxed)] = std::uint32_t(i);
+                    });
+                }
+            }
+        });
+
+        // The threads fill each cell in no particular order, so sort them to
+        // make ties between equally distant things resolve the same way in
+        // every build
+        detail::parallel_chunks(thread_count, cell_count, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t c = begin; c < end; c++) {
+                std::sort(refs_.begin() + cell_start_[c], refs_.begin() + cell_start_[c + 1]);
+            }
+        });
+    }
+
+    // Finds the closest of the things hit by the ray (see test_closer())
+    template <typename Things>
+    intersection intersect(const ray& ray_, const Things& things) const
+    {
+        intersection closest{};
+        // Kept apart from closest so that it can stay in a register
+        real_t closest_dist = no_hit;
+
+        const auto test = [&](std::uint32_t idx) { detail::test_closer(things[idx], ray_, closest, closest_dist); };
+
+        unbounded_.intersect(ray_, things, closest, closest_dist);
+
+        if (cell_start_.empty()) {
+            return closest;
+        }
+
+        const real_t start[3] = {ray_.start.x, ray_.start.y, ray_.start.z};
+        const real_t dir[3] = {ray_.dir.x, ray_.dir.y, ray_.dir.z};
+        const real_t lower[3] = {bounds_.lower.x, bounds_.lower.y, bounds_.lower.z};
+        const real_t upper[3] = {bounds_.upper.x, bounds_.upper.y, bounds_.upper.z};
+        const real_t cell_size[3] = {cell_size_.x, cell_size_.y, cell_size_.z};
+
+        // Clip the ray to the grid, and to any closer hit on an unbounded thing
+        real_t t_enter = 0;
+        real_t t_exit = closest_dist;
+        for (int a = 0; a < 3; a++) {
+            if (dir[a] == 0) {
+                if (start[a] < lower[a] || start[a] > upper[a]) {
+                    return closest;
+                }
+                continue;
+            }
+            real_t t1 = (lower[a] - start[a]) / dir[a];
+            real_t t2 = (upper[a] - start[a]) / dir[a];
+            if (t1 > t2) {
+                std::swap(t1, t2);
+            }
+            t_enter = std::max(t_enter, t1);
+            t_exit = std::min(t_exit, t2);
+        }
+        if (t_enter > t_exit) {
+            return closest;
+        }
+
+        // For each axis, the cell the ray is in, the distance at which it
+        // crosses into the next one, and the distance between crossings
+        constexpr real_t inf = std::numeric_limits<real_t>::infinity();
+        int cell[3];
+        int step[3];
+        int end[3];
+        real_t next[3];
+        real_t delta[3];
+        for (int a = 0; a < 3; a++) {
+            const real_t pos = start[a] + t_enter * dir[a];
+            cell[a] = std::clamp(int((pos - lower[a]) * inv_cell_size_[a]), 0, res_[a] - 1);
+            if (dir[a] > 0) {
+                step[a] = 1;
+                end[a] = res_[a];
+                next[a] = (lower[a] + (cell[a] + 1) * cell_size[a] - start[a]) / dir[a];
+                delta[a] = cell_size[a] / dir[a];
+            } else if (dir[a] < 0) {
+                step[a] = -1;
+                end[a] = -1;
+                next[a] = (lower[a] + cell[a] * cell_size[a] - start[a]) / dir[a];
+                delta[a] = -cell_size[a] / dir[a];
+            } else {
+                step[a] = 0;
+                end[a] = -1;
+                next[a] = inf;
+                delta[a] = inf;
+            }
+        }
+
+        while (true) {
+            const std::size_t c = cell[0] + std::size_t(res_[0]) * (cell[1] + std::size_t(res_[1]) * cell[2]);
+            for (std::uint32_t r = cell_start_[c]; r < cell_start_[c + 1]; r++) {
+                test(refs_[r]);
+            }
+
+            // Anything in the cells beyond is hit further away than a hit
+            // inside this one
+            const int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            if (closest_dist <= next[a] || next[a] > t_exit) {
+                break;
+            }
+            cell[a] += step[a];
+            if (cell[a] == end[a]) {
+                break;
+            }
+            next[a] += delta[a];
+        }
+
+        return closest;
+    }
+
+    const int* get_resolution() const { return res_; }
+
+    // The number of references from cells to things; since a thing is
+    // referenced by every cell it overlaps, usually more than the number of
+    // things
+    std::size_t get_ref_count() const { return refs_.size(); }
+
+    // The number of bytes taken by the cells and references
+    std::size_t get_memory_size() const
+    {
+        return (cell_start_.size() + refs_.size()) * sizeof(std::uint32_t) + unbounded_.get_memory_size();
+    }
+
+private:
+    // Roughly how many cells to make for each thing
+    static constexpr real_t cells_per_thing = 2.0;
+    static constexpr int max_resolution = 1024;
+
+    struct cell_range {
+        int lower[3];
+        int upper[3];
+    };
+
+    void choose_resolution(std::size_t bounded)
+    {
+        const vec3 extent = bounds_.upper - bounds_.lower;
+        const real_t ext[3] = {extent.x, extent.y, extent.z};
+        // Flat (or empty) dimensions are given a nominal thickness, so that
+        // the cells don't come out infinitely wide in the others
+        const real_t max_ext = std::max({ext[0], ext[1], ext[2]});
+        const real_t min_ext = std::max(max_ext * real_t(1e-3), std::numeric_limits<real_t>::min());
+        const real_t volume = std::max(ext[0], min_ext) * std::max(ext[1], min_ext) * std::max(ext[2], min_ext);
+        const real_t cells_per_unit = std::cbrt(cells_per_thing * real_t(bounded) / volume);
+
+        real_t size[3];
+        for (int a = 0; a < 3; a++) {
+            res_[a] = std::clamp(int(std::ceil(ext[a] * cells_per_unit)), 1, max_resolution);
+            size[a] = ext[a] / res_[a];
+            inv_cell_size_[a] = ext[a] > 0 ? res_[a] / ext[a] : 0;
+        }
+        cell_size_ = {size[0], size[1], size[2]};
+    }
+
+    cell_range get_cell_range(const aabb& b) const
+    {
+        const real_t lo[3] = {b.lower.x - bounds_.lower.x, b.lower.y - bounds_.lower.y, b.lower.z - bounds_.lower.z};
+        const real_t hi[3] = {b.upper.x - bounds_.lower.x, b.upper.y - bounds_.lower.y, b.upper.z - bounds_.lower.z};
+        cell_range r;
+        for (int a = 0; a < 3; a++) {
+            r.lower[a] = std::clamp(int(lo[a] * inv_cell_size_[a]), 0, res_[a] - 1);
+            r.upper[a] = std::clamp(int(hi[a] * inv_cell_size_[a]), 0, res_[a] - 1);
+        }
+        return r;
+    }
+
+    aabb bounds_ = aabb::empty();
+    vec3 cell_size_{};
+    real_t inv_cell_size_[3] = {};
+    int res_[3] = {};
+    std::pmr::vector<std::uint32_t> cell_start_; // one more entry than there are cells
+    std::pmr::vector<std::uint32_t> refs_;       // indices of the things in each cell
+    unbounded_list unbounded_;
+};
+
+} // end namespace rt
@@ -0,0 +1,147 @@
+
+/*
+ * Half-precision (fp16) storage
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace rt {
+
+// An IEEE 754 binary16 number. This is a storage type only: it converts
+// implicitly to and from float, and all arithmetic is done in float.
+// Conversions round to nearest even, and handle subnormals, infinities and
+// NaNs. Values above 65504 become infinity.
+class half {
+public:
+    half() = default;
+
+    half(float f) : bits_{from_float(f)} {}
+
+    operator float() const { return to_float(bits_); }
+
+    std::uint16_t get_bits() const { return bits_; }
+
+private:
+    static std::uint32_t as_bits(float f)
+    {
+        std::uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    static float as_float(std::uint32_t u)
+    {
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+    // After Fabian Giesen's float_to_half_fast3_rtne
+    static std::uint16_t from_float(float f)
+    {
+        constexpr std::uint32_t f32_infinity = 255u << 23;
+        constexpr std::uint32_t f16_limit = (127u + 16) << 23;
+        constexpr std::uint32_t denorm_magic = ((127u - 15) + (23 - 10) + 1) << 23;
+
+        std::uint32_t u = as_bits(f);
+        const std::uint32_t sign = u & 0x80000000u;
+        u ^= sign;
+
+        std::uint16_t h;
+        if (u >= f16_limit) {
+            // Too big, infinity or NaN
+            h = u > f32_infinity ? 0x7e00 : 0x7c00;
+        } else if (u < (113u << 23)) {
+            // Subnormal or zero: let the FPU do the rounding
+            h = std::uint16_t(as_bits(as_float(u) + as_float(denorm_magic)) - denorm_magic);
+        } else {
+            const std::uint32_t mantissa_odd = (u >> 13) & 1;
+            u += (std::uint32_t(15 - 127) << 23) + 0xfff;
+            u += mantissa_odd;
+            h = std::uint16_t(u >> 13);
+        }
+        return std::uint16_t(h | (sign >> 16));
+    }
+
+    static float to_float(std::uint16_t h)
+    {
+        constexpr std::uint32_t shifted_exp = 0x7c00u << 13;
+
+        std::uint32_t u = (h & 0x7fffu) << 13;
+        const std::uint32_t exp = u & shifted_exp;
+        u += (127u - 15) << 23;
+        if (exp == shifted_exp) {
+            // Infinity or NaN
+            u += (128u - 16) << 23;
+        } else if (exp == 0) {
+            // Subnormal or zero
+            u += 1u << 23;
+            u = as_bits(as_float(u) - as_float(113u << 23));
+        }
+        return as_float(u | (std::uint32_t(h & 0x8000u) << 16));
+    }
+
+    std::uint16_t bits_ = 0;
+};
+
+// A framebuffer which keeps the unclamped pixel colours at half precision,
+// taking 6 bytes per pixel rather than the 12 of float (or 24 of double)
+// colours
+struct half_canvas {
+    int width;
+    int height;
+
+    half_canvas(int width, int height)
+            : width{width},
+              height{height},
+              pixels_(std::size_t(width) * height)
+    {}
+
+    void set_pixel(int x, int y, const color& col)
+    {
+        pixels_[x + std::size_t(width) * y] = basic_color<half>{basic_color<float>{col}};
+    }
+
+    color get_pixel(int x, int y) const
+    {
+        return color{basic_color<float>{pixels_[x + std::size_t(width) * y]}};
+    }
+
+    // Writes every pixel to canvas, which must be at least as large
+    template <typename Canvas>
+    void copy_to(Canvas& canvas) const
+    {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                canvas.set_pixel(x, y, get_pixel(x, y));
+            }
+        }
+    }
+
+    const auto& get_pixels() const { return pixels_; }
+
+private:
+    std::vector<basic_color<half>> pixels_;
+};
+
+} // end namespace rt
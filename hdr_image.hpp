@@ -0,0 +1,413 @@
+
+/*
+ * High dynamic range framebuffer and image output
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "byte_buffer.hpp"
+#include "half.hpp"
+#include "quantise.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace rt {
+
+// A framebuffer which keeps linear, unclamped colours, so that the image can
+// be written out as HDR or tonemapped at any exposure without re-rendering
+struct hdr_canvas {
+    int width;
+    int height;
+
+    hdr_canvas(int width, int height)
+            : width{width},
+              height{height},
+              pixels_(std::size_t(width) * height)
+    {}
+
+    void set_pixel(int x, int y, const color& col)
+    {
+        pixels_[x + std::size_t(width) * y] = basic_color<float>{col};
+    }
+
+    color get_pixel(int x, int y) const
+    {
+        return color{pixels_[x + std::size_t(width) * y]};
+    }
+
+    const auto& get_pixels() const { return pixels_; }
+
+private:
+    std::vector<basic_color<float>> pixels_;
+};
+
+// Scales every pixel by exposure, then clamps and quantises it to 8-bit
+// RGBA. This is a separate pass over the finished image, so the exposure can
+// be changed without re-rendering.
+inline std::vector<std::uint8_t> tonemap(const hdr_canvas& canvas, const quantise_options& opts = {})
+{
+    std::vector<std::uint8_t> out(canvas.get_pixels().size() * 4);
+    for (int y = 0; y < canvas.height; y++) {
+        const std::size_t row = std::size_t(canvas.width) * y;
+        quantise_rgba8(&canvas.get_pixels()[row], &out[4 * row], canvas.width, 0, y, opts);
+    }
+    return out;
+}
+
+// Writes a Radiance RGBE (.hdr) image, with run-length encoded scanlines.
+//
+// Tiles may be passed to write_tile() in any order, from a canvas which
+// holds every tile written so far. The format stores scanlines from top to
+// bottom, so each scanline is encoded and written out as soon as all the
+// tiles covering it have arrived.
+class rgbe_writer {
+public:
+    rgbe_writer(std::FILE* out, int width, int height)
+            : out_{out},
+              width_{width},
+              height_{height},
+              row_filled_(height)
+    {
+        std::fprintf(out_, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height_, width_);
+    }
+
+    template <typename Canvas>
+    void write_tile(const Canvas& canvas, const tile& tile_)
+    {
+        for (int y = tile_.y; y < tile_.y + tile_.height; y++) {
+            row_filled_[y] += tile_.width;
+        }
+        while (next_row_ < height_ && row_filled_[next_row_] == width_) {
+            write_row(canvas, next_row_++);
+        }
+    }
+
+    bool is_complete() const { return next_row_ == height_; }
+
+private:
+    static constexpr int min_run = 4;
+
+    static void to_rgbe(const color& col, std::uint8_t* rgbe)
+    {
+        const float r = std::max(float(col.r), 0.0f);
+        const float g = std::max(float(col.g), 0.0f);
+        const float b = std::max(float(col.b), 0.0f);
+        const float v = std::max({r, g, b});
+        if (v < 1e-32f) {
+            rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+            return;
+        }
+        int e;
+        const float m = std::frexp(v, &e) * 256.0f / v;
+        rgbe[0] = std::uint8_t(r * m);
+        rgbe[1] = std::uint8_t(g * m);
+        rgbe[2] = std::uint8_t(b * m);
+        rgbe[3] = std::uint8_t(e + 128);
+    }
+
+    // Encodes one component of a scanline as a sequence of runs (a count
+    // above 128, then the repeated byte) and literals (a count up to 128,
+    // then the bytes)
+    void encode_component(const std::uint8_t* data, int n)
+    {
+        auto& out = buf_.bytes;
+        int cur = 0;
+        while (cur < n) {
+            // Find the next run of at least min_run bytes, if there is one
+            int run_start = cur;
+            int run_count = 0;
+            int prev_run_count = 0;
+            while (run_count < min_run && run_start < n) {
+                run_start += run_count;
+                prev_run_count = run_count;
+                run_count = 1;
+                while (run_start + run_count < n && run_count < 127 &&
+                       data[run_start] == data[run_start + run_count]) {
+                    run_count++;
+                }
+            }
+            // A short run immediately before it is still worth encoding
+            if (prev_run_count > 1 && prev_run_count == run_start - cur) {
+                out.push_back(std::uint8_t(128 + prev_run_count));
+                out.push_back(data[cur]);
+                cur = run_start;
+            }
+            while (cur < run_start) {
+                const int literal = std::min(128, run_start - cur);
+                out.push_back(std::uint8_t(literal));
+                out.insert(out.end(), data + cur, data + cur + literal);
+                cur += literal;
+            }
+            if (run_count >= min_run) {
+                out.push_back(std::uint8_t(128 + run_count));
+                out.push_back(data[run_start]);
+                cur += run_count;
+            }
+        }
+    }
+
+    template <typename Canvas>
+    void write_row(const Canvas& canvas, int y)
+    {
+        rgbe_.resize(std::size_t(width_) * 4);
+        for (int x = 0; x < width_; x++) {
+            to_rgbe(canvas.get_pixel(x, y), &rgbe_[4 * std::size_t(x)]);
+        }
+
+        buf_.bytes.clear();
+        if (width_ < 8 || width_ > 0x7fff) {
+            // Too narrow or too wide to be run-length encoded
+            buf_.bytes = rgbe_;
+        } else {
+            buf_.put_u8(2);
+            buf_.put_u8(2);
+            buf_.put_u8(std::uint8_t(width_ >> 8));
+            buf_.put_u8(std::uint8_t(width_ & 0xff));
+            component_.resize(width_);
+            for (int c = 0; c < 4; c++) {
+                for (int x = 0; x < width_; x++) {
+                    component_[x] = rgbe_[4 * std::size_t(x) + c];
+                }
+                encode_component(component_.data(), width_);
+            }
+        }
+        buf_.write(out_);
+    }
+
+    std::FILE* out_;
+    int width_;
+    int height_;
+    std::vector<int> row_filled_;
+    int next_row_ = 0;
+    std::vector<std::uint8_t> rgbe_;
+    std::vector<std::uint8_t> component_;
+    detail::byte_buffer buf_;
+};
+
+// Writes a tiled OpenEXR image with half-float R, G and B channels,
+// optionally RLE compressed.
+//
+// The file is laid out as a header, a table of offsets with one entry for
+// each tile, and then the tiles themselves in the order they were written,
+// so tiles can be streamed out as they finish. The offset table is filled in
+// by finish(), so the output must be seekable. Each tile passed to
+// write_tile() must be one of the writer's tiles, i.e. it must be aligned to
+// (and no larger than) tile_size.
+class exr_writer {
+public:
+    enum class compression : std::uint8_t { none = 0, rle = 1 };
+
+    exr_writer(std::FILE* out, int width, int height, int tile_size = 32,
+               compression compression_ = compression::rle)
+            : out_{out},
+              width_{width},
+              height_{height},
+              tile_size_{tile_size},
+              tiles_x_{(width + tile_size - 1) / tile_size},
+              compression_{compression_},
+              offsets_(std::size_t(tiles_x_) * ((height + tile_size - 1) / tile_size))
+    {
+        detail::byte_buffer header;
+        header.put_u32(20000630);           // magic number
+        header.put_u32(2 | 0x200);          // version 2, tiled
+
+        header.put_str("channels");
+        header.put_str("chlist");
+        header.put_u32(3 * 18 + 1);
+        for (const char* name : {"B", "G", "R"}) {
+            header.put_str(name);
+            header.put_u32(1);              // half
+            header.put_u32(0);              // pLinear and reserved
+            header.put_u32(1);              // x sampling
+            header.put_u32(1);              // y sampling
+        }
+        header.put_u8(0);
+
+        header.put_str("compression");
+        header.put_str("compression");
+        header.put_u32(1);
+        header.put_u8(std::uint8_t(compression_));
+
+        for (const char* window : {"dataWindow", "displayWindow"}) {
+            header.put_str(window);
+            header.put_str("box2i");
+            header.put_u32(16);
+            header.put_u32(0);
+            header.put_u32(0);
+            header.put_u32(std::uint32_t(width_ - 1));
+            header.put_u32(std::uint32_t(height_ - 1));
+        }
+
+        header.put_str("lineOrder");
+        header.put_str("lineOrder");
+        header.put_u32(1);
+        header.put_u8(2);                   // random y
+
+        header.put_str("pixelAspectRatio");
+        header.put_str("float");
+        header.put_u32(4);
+        header.put_f32(1.0f);
+
+        header.put_str("screenWindowCenter");
+        header.put_str("v2f");
+        header.put_u32(8);
+        header.put_f32(0.0f);
+        header.put_f32(0.0f);
+
+        header.put_str("screenWindowWidth");
+        header.put_str("float");
+        header.put_u32(4);
+        header.put_f32(1.0f);
+
+        header.put_str("tiles");
+        header.put_str("tiledesc");
+        header.put_u32(9);
+        header.put_u32(std::uint32_t(tile_size_));
+        header.put_u32(std::uint32_t(tile_size_));
+        header.put_u8(0);                   // one level
+
+        header.put_u8(0);                   // end of header
+        header.write(out_);
+
+        // Leave space for the offset table
+        table_pos_ = std::ftell(out_);
+        detail::byte_buffer table;
+        for (std::size_t i = 0; i < offsets_.size(); i++) {
+            table.put_u64(0);
+        }
+        table.write(out_);
+    }
+
+    template <typename Canvas>
+    void write_tile(const Canvas& canvas, const tile& tile_)
+    {
+        const int tx = tile_.x / tile_size_;
+        const int ty = tile_.y / tile_size_;
+        offsets_[std::size_t(ty) * tiles_x_ + tx] = std::uint64_t(std::ftell(out_));
+
+        // Each scanline holds all of its B values, then G, then R
+        raw_.bytes.clear();
+        for (int y = tile_.y; y < tile_.y + tile_.height; y++) {
+            for (int c = 2; c >= 0; c--) {
+                for (int x = tile_.x; x < tile_.x + tile_.width; x++) {
+                    const color col = canvas.get_pixel(x, y);
+                    raw_.put_u16(half(float(c == 0 ? col.r : c == 1 ? col.g : col.b)).get_bits());
+                }
+            }
+        }
+
+        const auto* data = &raw_.bytes;
+        if (compression_ == compression::rle) {
+            compress_rle();
+            // Data which doesn't shrink is stored uncompressed
+            if (packed_.size() < raw_.bytes.size()) {
+                data = &packed_;
+            }
+        }
+
+        detail::byte_buffer chunk;
+        chunk.put_u32(std::uint32_t(tx));
+        chunk.put_u32(std::uint32_t(ty));
+        chunk.put_u32(0);                   // level
+        chunk.put_u32(0);
+        chunk.put_u32(std::uint32_t(data->size()));
+        chunk.write(out_);
+        std::fwrite(data->data(), 1, data->size(), out_);
+    }
+
+    // Fills in the offset table. Call once every tile has been written.
+    void finish()
+    {
+        const long end = std::ftell(out_);
+        std::fseek(out_, table_pos_, SEEK_SET);
+        detail::byte_buffer table;
+        for (const auto offset : offsets_) {
+            table.put_u64(offset);
+        }
+        table.write(out_);
+        std::fseek(out_, end, SEEK_SET);
+        std::fflush(out_);
+    }
+
+private:
+    static constexpr int min_run = 3;
+    static constexpr int max_run = 127;
+
+    // OpenEXR's RLE scheme: the bytes are split into even and odd halves,
+    // delta encoded, and then written as runs (a count of n - 1, then the
+    // repeated byte) and literals (minus the count, then the bytes)
+    void compress_rle()
+    {
+        const auto& in = raw_.bytes;
+        const std::size_t n = in.size();
+        delta_.resize(n);
+        for (std::size_t i = 0, half_n = (n + 1) / 2; i < n; i++) {
+            delta_[(i % 2) ? half_n + i / 2 : i / 2] = in[i];
+        }
+        int prev = delta_.empty() ? 0 : delta_[0];
+        for (std::size_t i = 1; i < n; i++) {
+            const int d = int(delta_[i]) - prev + (128 + 256);
+            prev = delta_[i];
+            delta_[i] = std::uint8_t(d);
+        }
+
+        packed_.clear();
+        std::size_t run_start = 0;
+        std::size_t run_end = 1;
+        while (run_start < n) {
+            while (run_end < n && delta_[run_start] == delta_[run_end] &&
+                   run_end - run_start - 1 < max_run) {
+                ++run_end;
+            }
+            if (run_end - run_start >= min_run) {
+                packed_.push_back(std::uint8_t(run_end - run_start - 1));
+                packed_.push_back(delta_[run_start]);
+                run_start = run_end;
+            } else {
+                while (run_end < n &&
+                       ((run_end + 1 >= n || delta_[run_end] != delta_[run_end + 1]) ||
+                        (run_end + 2 >= n || delta_[run_end + 1] != delta_[run_end + 2])) &&
+                       run_end - run_start < max_run) {
+                    ++run_end;
+                }
+                packed_.push_back(std::uint8_t(-int(run_end - run_start)));
+                packed_.insert(packed_.end(), delta_.begin() + run_start, delta_.begin() + run_end);
+                run_start = run_end;
+            }
+            ++run_end;
+        }
+    }
+
+    std::FILE* out_;
+    int width_;
+    int height_;
+    int tile_size_;
+    int tiles_x_;
+    compression compression_;
+    std::vector<std::uint64_t> offsets_;
+    long table_pos_ = 0;
+    detail::byte_buffer raw_;
+    std::vector<std::uint8_t> delta_;
+    std::vector<std::uint8_t> packed_;
+};
+
+} // end namespace rt
@@ -0,0 +1,135 @@
+
+/*
+ * Two-level instancing of repeated geometry
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "bvh.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace rt {
+
+// A unique piece of geometry, in its own object space, together with its
+// bottom-level acceleration structure (BLAS). It is shared between all the
+// instances which use it.
+struct object_geometry {
+    explicit object_geometry(std::vector<any_thing> things)
+            : things(std::move(things)),
+              accel{this->things}
+    {}
+
+    std::vector<any_thing> things;
+    bvh accel;
+};
+
+// A placement of an object_geometry in the world. Rays are transformed into
+// the object's space and traced through its BLAS, so each instance costs a
+// pointer and a transform however large the geometry is.
+class instance {
+public:
+    instance(std::shared_ptr<const object_geometry> geom, const transform& xform)
+            : geom_{std::move(geom)},
+              xform_{xform},
+              bounds_{world_bounds(*geom_, xform_)}
+    {}
+
+    std::optional<aabb> get_bounds() const { return bounds_; }
+
+    const transform& get_transform() const { return xform_; }
+
+    intersection intersect(const ray& ray_) const
+    {
+        const ray object_ray{xform_.to_object_point(ray_.start), xform_.to_object_dir(ray_.dir)};
+        if (const auto inter = geom_->accel.intersect(object_ray, geom_->things)) {
+            return {inter.thing_, &xform_, inter.dist * xform_.scale};
+        }
+        return {};
+    }
+
+private:
+    static aabb world_bounds(const object_geometry& geom, const transform& xform)
+    {
+        aabb bounds = aabb::empty();
+        for (const auto& t : geom.things) {
+            if (const auto b = t.get_bounds()) {
+                bounds.expand(xform.to_world(*b));
+            }
+        }
+        return bounds;
+    }
+
+    std::shared_ptr<const object_geometry> geom_;
+    transform xform_;
+    aabb bounds_;
+};
+
+// A scene made of ordinary things plus instances of shared geometry. The
+// instances are held in a top-level acceleration structure (TLAS) whose
+// leaves are instances; each instance then traverses its own BLAS.
+//
+// Instanced geometry must be bounded: unbounded things such as planes should
+// be added to the scene directly.
+class instanced_scene {
+public:
+    instanced_scene(std::vector<any_thing> things, std::vector<light> lights, const camera& cam)
+            : things_(std::move(things)),
+              lights_(std::move(lights)),
+              cam_{cam},
+              things_bvh_{things_}
+    {}
+
+    void add_instance(std::shared_ptr<const object_geometry> geom, const transform& xform)
+    {
+        instances_.emplace_back(std::move(geom), xform);
+    }
+
+    // Rebuilds the TLAS; must be called after adding instances
+    void build() { tlas_.build(instances_); }
+
+    const auto& get_things() const { return things_; }
+
+    const auto& get_lights() const { return lights_; }
+
+    const auto& get_camera() const { return cam_; }
+
+    const auto& get_instances() const { return instances_; }
+
+    intersection intersect(const ray& ray_) const
+    {
+        // The TLAS only looks for instances hit before the nearest thing, so
+        // that anything behind it is culled
+        const auto inter = things_bvh_.intersect(ray_, things_);
+        if (const auto inst_inter = tlas_.intersect(ray_, instances_, inter.dist)) {
+            return inst_inter;
+        }
+        return inter;
+    }
+
+private:
+    std::vector<any_thing> things_;
+    std::vector<light> lights_;
+    camera cam_;
+    bvh things_bvh_;
+    std::vector<instance> instances_;
+    bvh tlas_;
+};
+
+} // end namespace rt
@@ -0,0 +1,275 @@
+
+/*
+ * Light culling and sampling for scenes with many lights
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <vector>
+
+namespace rt {
+
+struct light_sampling {
+    // Lights whose estimated contribution at a point (the luminance of their
+    // colour after falloff) is below the cutoff are skipped there. This is a
+    // heuristic threshold rather than an error bound: the shading a skipped
+    // light would have added also depends on the surface's diffuse and
+    // specular response and on any reflections, and can exceed the estimate.
+    real_t cutoff = 0;
+    // If non-zero, at most this many of the lights which pass the cutoff are
+    // evaluated at each point. They are chosen at random, in proportion to
+    // their estimated contribution, and weighted so that the expected
+    // result is unchanged.
+    int max_lights = 0;
+};
+
+// A BVH over the spheres of influence of the lights with finite range, used
+// to find the lights which can reach a point without testing every light.
+// Lights with infinite range are kept in a separate list and always
+// considered.
+class light_tree {
+public:
+    // The tree is allocated from mr, which must outlive it
+    explicit light_tree(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : bounded_(mr),
+              unbounded_(mr),
+              nodes_(mr)
+    {}
+
+    template <typename Lights>
+    explicit light_tree(const Lights& lights, const light_sampling& sampling = {},
+                        std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : sampling_{sampling},
+              bounded_(mr),
+              unbounded_(mr),
+              nodes_(mr)
+    {
+        for (std::uint32_t i = 0; i < lights.size(); i++) {
+            (lights[i].has_range() ? bounded_ : unbounded_).push_back({lights[i], i});
+        }
+        if (!bounded_.empty()) {
+            nodes_.reserve(2 * bounded_.size());
+            nodes_.push_back({aabb::empty(), 0, std::uint32_t(bounded_.size())});
+            subdivide(0);
+        }
+    }
+
+    // Calls func(light) for each light which reaches pos, in the order the
+    // lights were given, with each light's colour scaled by its falloff and
+    // (if sampling) its sampling weight
+    template <typename Func>
+    void for_each_light(const vec3& pos, Func&& func) const
+    {
+        // Reused by every query on this thread, to avoid allocating
+        thread_local std::vector<candidate> candidates;
+        candidates.clear();
+
+        for (const auto& l : unbounded_) {
+            add_candidate(candidates, l, 1.0);
+        }
+
+        if (!nodes_.empty()) {
+            std::uint32_t stack[64];
+            int stack_size = 0;
+            stack[stack_size++] = 0;
+            while (stack_size > 0) {
+                const node& n = nodes_[stack[--stack_size]];
+                if (!contains(n.bounds, pos)) {
+                    continue;
+                }
+                if (n.count > 0) {
+                    for (auto i = n.left_first; i < n.left_first + n.count; i++) {
+                        const vec3 d = bounded_[i].light_.pos - pos;
+                        if (const real_t f = bounded_[i].light_.falloff(dot(d, d)); f > 0) {
+                            add_candidate(candidates, bounded_[i], f);
+                        }
+                    }
+                } else {
+                    stack[stack_size++] = n.left_first;
+                    stack[stack_size++] = n.left_first + 1;
+                }
+            }
+        }
+
+        // Always sum the lights in the same order, whatever order the tree
+        // found them in
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const candidate& a, const candidate& b) { return a.index < b.index; });
+
+        if (sampling_.max_lights > 0 && candidates.size() > std::size_t(sampling_.max_lights)) {
+            sample(candidates, pos);
+        }
+
+        for (const auto& c : candidates) {
+            if (c.weight == 1 && c.falloff == 1) {
+                func(*c.light_);
+            } else if (c.weight > 0) {
+                func(light{c.light_->pos, scale(c.falloff * c.weight, c.light_->col), c.light_->range});
+            }
+        }
+    }
+
+    const light_sampling& get_sampling() const { return sampling_; }
+
+private:
+    struct indexed_light {
+        light light_;
+        std::uint32_t index;
+    };
+
+    struct candidate {
+        const light* light_;
+        std::uint32_t index;
+        real_t falloff;
+        real_t estimate;
+        real_t weight;
+    };
+
+    struct node {
+        aabb bounds;
+        std::uint32_t left_first;
+        std::uint32_t count; // zero for interior nodes
+    };
+
+    static constexpr std::uint32_t max_leaf_size = 4;
+
+    static real_t luminance(const color& c)
+    {
+        return real_t{0.2126} * c.r + real_t{0.7152} * c.g + real_t{0.0722} * c.b;
+    }
+
+    static bool contains(const aabb& box, const vec3& p)
+    {
+        return p.x >= box.lower.x && p.y >= box.lower.y && p.z >= box.lower.z &&
+               p.x <= box.upper.x && p.y <= box.upper.y && p.z <= box.upper.z;
+    }
+
+    void add_candidate(std::vector<candidate>& candidates, const indexed_light& l, real_t f) const
+    {
+        const real_t estimate = luminance(l.light_.col) * f;
+        if (estimate >= sampling_.cutoff) {
+            candidates.push_back({&l.light_, l.index, f, estimate, 1.0});
+        }
+    }
+
+    // All the bits of v, folded into 32
+    static std::uint32_t hash_bits(real_t v)
+    {
+        static_assert(sizeof(real_t) == 4 || sizeof(real_t) == 8, "real_t must be float or double");
+        if constexpr (sizeof(real_t) == 8) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &v, sizeof(bits));
+            return std::uint32_t(bits ^ (bits >> 32));
+        } else {
+            std::uint32_t bits;
+            std::memcpy(&bits, &v, sizeof(bits));
+            return bits;
+        }
+    }
+
+    // Replaces the candidates' weights by those of max_lights samples drawn
+    // with probability proportional to their estimates. The random numbers
+    // are a hash of the shading position, so the same point always picks the
+    // same lights.
+    void sample(std::vector<candidate>& candidates, const vec3& pos) const
+    {
+        real_t total = 0;
+        for (auto& c : candidates) {
+            total += c.estimate;
+            c.weight = 0;
+        }
+        if (total <= 0) {
+            return;
+        }
+
+        std::uint32_t state = hash_bits(pos.x) * 0x9E3779B1u ^ hash_bits(pos.y) * 0x85EBCA77u ^
+                              hash_bits(pos.z) * 0xC2B2AE3Du;
+
+        const int n = sampling_.max_lights;
+        for (int s = 0; s < n; s++) {
+            // PCG-style output hash of a counter
+            state = state * 747796405u + 2891336453u;
+            std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+            word = (word >> 22u) ^ word;
+            const real_t u = real_t(word >> 8) / real_t(1u << 24) * total;
+
+            real_t acc = 0;
+            auto chosen = candidates.size() - 1;
+            for (std::size_t i = 0; i < candidates.size(); i++) {
+                acc += candidates[i].estimate;
+                if (u < acc) {
+                    chosen = i;
+                    break;
+                }
+            }
+            candidates[chosen].weight += total / (n * candidates[chosen].estimate);
+        }
+    }
+
+    void subdivide(std::uint32_t node_idx)
+    {
+        node& n = nodes_[node_idx];
+        aabb bounds = aabb::empty();
+        for (auto i = n.left_first; i < n.left_first + n.count; i++) {
+            const light& l = bounded_[i].light_;
+            bounds.expand(aabb{l.pos - vec3{l.range, l.range, l.range},
+                               l.pos + vec3{l.range, l.range, l.range}});
+        }
+        n.bounds = bounds;
+        if (n.count <= max_leaf_size) {
+            return;
+        }
+
+        // Median split along the longest axis of the light positions
+        aabb centres = aabb::empty();
+        for (auto i = n.left_first; i < n.left_first + n.count; i++) {
+            centres.expand(bounded_[i].light_.pos);
+        }
+        const vec3 extent = centres.upper - centres.lower;
+        const auto key = [axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2]
+                (const indexed_light& l) {
+            return axis == 0 ? l.light_.pos.x : axis == 1 ? l.light_.pos.y : l.light_.pos.z;
+        };
+        const auto first = bounded_.begin() + n.left_first;
+        const auto mid = first + n.count / 2;
+        std::nth_element(first, mid, first + n.count,
+                         [&](const indexed_light& a, const indexed_light& b) { return key(a) < key(b); });
+
+        const auto left_idx = std::uint32_t(nodes_.size());
+        const std::uint32_t left_first = n.left_first;
+        const std::uint32_t count = n.count;
+        nodes_.push_back({aabb::empty(), left_first, count / 2});
+        nodes_.push_back({aabb::empty(), left_first + count / 2, count - count / 2});
+        nodes_[node_idx].left_first = left_idx;
+        nodes_[node_idx].count = 0;
+
+        subdivide(left_idx);
+        subdivide(left_idx + 1);
+    }
+
+    light_sampling sampling_{};
+    std::pmr::vector<indexed_light> bounded_;
+    std::pmr::vector<indexed_light> unbounded_;
+    std::pmr::vector<node> nodes_;
+};
+
+} // end namespace rt
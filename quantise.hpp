@@ -0,0 +1,178 @@
+
+/*
+ * Bulk conversion of colours to 8-bit RGBA
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+namespace rt {
+
+struct quantise_options {
+    // Each colour is multiplied by this before being clamped to [0, 1]
+    float exposure = 1.0f;
+    // Encode with the sRGB transfer curve, rather than writing linear values
+    bool srgb = false;
+    // Add a 4x4 ordered (Bayer) dither before truncating, to break up
+    // banding in smooth gradients
+    bool dither = false;
+};
+
+namespace detail {
+
+// 255 times the sRGB encoding of i / (srgb_lut_size - 1)
+constexpr int srgb_lut_size = 4096;
+
+inline const float* get_srgb_lut()
+{
+    static const auto lut = [] {
+        struct table { float values[srgb_lut_size]; } t{};
+        for (int i = 0; i < srgb_lut_size; i++) {
+            const double v = double(i) / (srgb_lut_size - 1);
+            const double s = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+            t.values[i] = float(255.0 * s);
+        }
+        return t;
+    }();
+    return lut.values;
+}
+
+// The dither threshold for pixel (x, y), in [0, 1)
+inline float get_dither(int x, int y)
+{
+    constexpr int bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+    return (float(bayer[y & 3][x & 3]) + 0.5f) / 16.0f;
+}
+
+// Without dithering or sRGB, values are truncated exactly as dynamic_canvas
+// always has, widening to double so that values just below a step are never
+// rounded up onto it. sRGB values are rounded to nearest, and dithered
+// values are truncated after the dither is added.
+template <typename T>
+std::uint8_t quantise(T val, const quantise_options& opts, float dither)
+{
+    if (!opts.srgb && !opts.dither) {
+        return std::uint8_t(double(std::clamp<T>(val * T(opts.exposure), 0, 1)) * 255.0);
+    }
+    const float v = std::clamp(float(val) * opts.exposure, 0.0f, 1.0f);
+    const float scaled = opts.srgb ? get_srgb_lut()[std::lrint(v * (srgb_lut_size - 1))] : v * 255.0f;
+    return std::uint8_t(std::min(scaled + (opts.dither ? dither : 0.5f * opts.srgb), 255.0f));
+}
+
+#ifdef RAYTRACER_HAVE_AVX2_KERNEL
+
+// Converts 8 floats from [0, 1] (after exposure and clamping) to integers
+__attribute__((target("avx2")))
+inline __m256i quantise8(__m256 v, const quantise_options& opts, __m256 dither, const float* lut)
+{
+    if (!opts.srgb && !opts.dither) {
+        const __m256d max_byte = _mm256_set1_pd(255.0);
+        const __m128i lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), max_byte));
+        const __m128i hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), max_byte));
+        return _mm256_set_m128i(hi, lo);
+    }
+    const __m256 scaled = opts.srgb
+            ? _mm256_i32gather_ps(lut, _mm256_cvtps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(srgb_lut_size - 1))), 4)
+            : _mm256_mul_ps(v, _mm256_set1_ps(255.0f));
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(scaled, dither), _mm256_set1_ps(255.0f)));
+}
+
+// Packs count pixels, starting at pixel (x, y) of the image, eight at a
+// time, returning the number packed. The colours are read as a flat array
+// of floats, three per pixel, so each group of eight pixels is three
+// vectors; they are clamped, scaled, converted and packed to 24 bytes, and
+// then shuffled out to RGBA.
+__attribute__((target("avx2")))
+inline int quantise_rgba8_avx2(const basic_color<float>* in, std::uint8_t* out, int count,
+                               int x, int y, const quantise_options& opts)
+{
+    static_assert(sizeof(basic_color<float>) == 3 * sizeof(float));
+    const float* src = &in[0].r;
+    const float* lut = opts.srgb ? get_srgb_lut() : nullptr;
+
+    // Float j of a group belongs to pixel j / 3, and groups start at
+    // multiples of 8 pixels, so the dither pattern is the same for each
+    alignas(32) float dither[24];
+    for (int j = 0; j < 24; j++) {
+        dither[j] = opts.dither ? get_dither(x + j / 3, y) : 0.5f * opts.srgb;
+    }
+    const __m256 dithers[3] = {_mm256_load_ps(dither), _mm256_load_ps(dither + 8), _mm256_load_ps(dither + 16)};
+
+    const __m256 exposure = _mm256_set1_ps(opts.exposure);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m128i to_rgba = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(int(0xff000000u));
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i ints[3];
+        for (int k = 0; k < 3; k++) {
+            const __m256 v = _mm256_loadu_ps(src + 3 * i + 8 * k);
+            ints[k] = quantise8(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, exposure), zero), one),
+                                opts, dithers[k], lut);
+        }
+        // 24 ints -> 24 bytes, in order: packs works within 128-bit lanes,
+        // so the words are put back in order before packing again
+        const __m256i words01 = _mm256_permute4x64_epi64(_mm256_packus_epi32(ints[0], ints[1]), 0xd8);
+        const __m256i words2 = _mm256_permute4x64_epi64(_mm256_packus_epi32(ints[2], ints[2]), 0xd8);
+        const __m128i bytes0 = _mm_packus_epi16(_mm256_castsi256_si128(words01),
+                                                _mm256_extracti128_si256(words01, 1));
+        const __m128i bytes1 = _mm_packus_epi16(_mm256_castsi256_si128(words2), _mm256_castsi256_si128(words2));
+        const __m128i rgba0 = _mm_or_si128(_mm_shuffle_epi8(bytes0, to_rgba), alpha);
+        const __m128i rgba1 = _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(bytes1, bytes0, 12), to_rgba), alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), rgba0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i + 16), rgba1);
+    }
+    return i;
+}
+
+#endif // RAYTRACER_HAVE_AVX2_KERNEL
+
+} // end namespace detail
+
+// Converts count colours, which are pixels (x, y) to (x + count - 1, y) of
+// the image, to 8-bit RGBA. The position is only used for dithering.
+template <typename T>
+void quantise_rgba8(const basic_color<T>* in, std::uint8_t* out, int count, int x, int y,
+                    const quantise_options& opts = {})
+{
+    int i = 0;
+#ifdef RAYTRACER_HAVE_AVX2_KERNEL
+    if constexpr (std::is_same_v<T, float>) {
+        if (count >= 8 && detail::cpu_has_avx2()) {
+            i = detail::quantise_rgba8_avx2(in, out, count, x, y, opts);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        const float dither = opts.dither ? detail::get_dither(x + i, y) : 0.0f;
+        out[4 * i] = detail::quantise(in[i].r, opts, dither);
+        out[4 * i + 1] = detail::quantise(in[i].g, opts, dither);
+        out[4 * i + 2] = detail::quantise(in[i].b, opts, dither);
+        out[4 * i + 3] = 255;
+    }
+}
+
+} // end namespace rt
@@ -29,11 +29,31 @@
 #include <cstdint>
 #include <limits>
 #include <optional>
+#include <type_traits>
 #include <variant>
 
 namespace rt {
 
-using real_t = float;
+// The scalar type used throughout the tracer. Define RAYTRACER_REAL_T before
+// including this header to build everything at another precision, e.g.
+// double for validating a float build.
+#ifndef RAYTRACER_REAL_T
+#define RAYTRACER_REAL_T float
+#endif
+
+using real_t = RAYTRACER_REAL_T;
+
+namespace detail {
+
+// Used to stop scalar arguments taking part in template argument deduction,
+// so that e.g. 2 * v works for a basic_vec3<float> v
+template <typename T>
+struct type_identity { using type = T; };
+
+template <typename T>
+using type_identity_t = typename type_identity<T>::type;
+
+} // end namespace detail
 
 // Constexpr maths functions.
 namespace cmath {
@@ -46,39 +66,56 @@ namespace cmath {
 
 // Compile-time square root using Newton-Raphson, adapted from
 // https://gist.github.com/alexshtf/eb5128b3e3e143187794
-constexpr real_t sqrt(real_t val)
+template <typename T>
+constexpr T sqrt(T val)
 {
 #ifdef HAVE_CONSTEXPR_STD_MATH
     return std::sqrt(val);
 #else
-    real_t curr = val;
-    real_t prev = 0;
+    T curr = val;
+    T prev = 0;
 
     while (curr != prev) {
         prev = curr;
-        curr = 0.5 * (curr + val/curr);
+        curr = T{0.5} * (curr + val/curr);
     }
 
     return curr;
 #endif
 }
 
-constexpr real_t floor(real_t val)
+template <typename T>
+constexpr T floor(T val)
 {
 #ifdef HAVE_CONSTEXPR_STD_MATH
     return std::floor(val);
 #else
     // This is wrong for anything outside the range of intmax_t
-    return static_cast<intmax_t>(val >= 0.0 ? val : val - 1.0);
+    return static_cast<intmax_t>(val >= 0 ? val : val - 1);
 #endif
 }
 
-constexpr real_t pow(real_t base, int iexp)
+// Integer powers by repeated squaring, so that a surface's roughness of a few
+// hundred costs a handful of multiplies. Once a squared base falls below the
+// smallest normal value, what is left of the result can only be smaller
+// still, so it is flushed to zero: carrying on would mean arithmetic on
+// subnormals, which is many times slower and which floats reach quickly.
+template <typename T>
+constexpr T pow(T base, int iexp)
 {
-    real_t val{1.0};
+    T val{1.0};
 
-    while (iexp-- > 0) {
-        val *= base;
+    while (iexp > 0) {
+        if (iexp % 2 != 0) {
+            val *= base;
+        }
+        iexp /= 2;
+        if (iexp > 0) {
+            base *= base;
+            if (base < std::numeric_limits<T>::min()) {
+                return T{0.0};
+            }
+        }
     }
 
     return val;
@@ -86,72 +123,199 @@ constexpr real_t pow(real_t base, int iexp)
 
 } // end namespace cmath
 
-struct vec3 {
-    real_t x;
-    real_t y;
-    real_t z;
+// The basic value types are templates over their scalar type, so that they
+// can also be used at other precisions than real_t, e.g. for storage (see
+// half.hpp). Everything else uses them through the real_t aliases below.
+template <typename T>
+struct basic_vec3 {
+    T x;
+    T y;
+    T z;
+
+    constexpr basic_vec3() = default;
+
+    constexpr basic_vec3(T x, T y, T z) : x{x}, y{y}, z{z} {}
+
+    // Converts from another precision
+    template <typename U>
+    constexpr explicit basic_vec3(const basic_vec3<U>& other)
+            : x(T(other.x)), y(T(other.y)), z(T(other.z))
+    {}
 };
 
-constexpr vec3 operator*(real_t k, const vec3& v)
+using vec3 = basic_vec3<real_t>;
+
+template <typename T>
+constexpr basic_vec3<T> operator*(detail::type_identity_t<T> k, const basic_vec3<T>& v)
 {
     return {k * v.x, k * v.y, k * v.z};
 }
 
-constexpr vec3 operator-(const vec3& v1, const vec3& v2)
+template <typename T>
+constexpr basic_vec3<T> operator-(const basic_vec3<T>& v1, const basic_vec3<T>& v2)
 {
     return {v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
 }
 
-constexpr vec3 operator+(const vec3& v1, const vec3& v2)
+template <typename T>
+constexpr basic_vec3<T> operator+(const basic_vec3<T>& v1, const basic_vec3<T>& v2)
 {
     return {v1.x + v2.x, v1.y + v2.y, v1.z + v2.z};
 }
 
-constexpr real_t dot(const vec3& v1, const vec3& v2)
+template <typename T>
+constexpr T dot(const basic_vec3<T>& v1, const basic_vec3<T>& v2)
 {
     return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
 }
 
-constexpr real_t mag(const vec3& v)
+template <typename T>
+constexpr T mag(const basic_vec3<T>& v)
 {
     return cmath::sqrt(dot(v, v));
 }
 
-constexpr vec3 norm(const vec3& v)
+template <typename T>
+constexpr basic_vec3<T> norm(const basic_vec3<T>& v)
 {
-    return (real_t{1.0} / mag(v)) * v;
+    return (T{1.0} / mag(v)) * v;
 }
 
-constexpr vec3 cross(const vec3& v1, const vec3& v2)
+template <typename T>
+constexpr basic_vec3<T> cross(const basic_vec3<T>& v1, const basic_vec3<T>& v2)
 {
     return { v1.y * v2.z - v1.z * v2.y,
              v1.z * v2.x - v1.x * v2.z,
              v1.x * v2.y - v1.y * v2.x };
 }
 
-struct color {
-    real_t r;
-    real_t g;
-    real_t b;
+// An axis-aligned bounding box
+struct aabb {
+    vec3 lower;
+    vec3 upper;
 
-    static constexpr color white() { return { 1.0, 1.0, 1.0 }; }
-    static constexpr color grey() { return { 0.5, 0.5, 0.5 }; }
-    static constexpr color black() { return {}; };
-    static constexpr color background() { return black(); }
-    static constexpr color default_color() { return black(); }
+    // Returns an "inverted" box, which contains nothing and which becomes
+    // the other box when expanded by it
+    static constexpr aabb empty()
+    {
+        constexpr real_t inf = std::numeric_limits<real_t>::infinity();
+        return {{inf, inf, inf}, {-inf, -inf, -inf}};
+    }
+
+    constexpr void expand(const aabb& other)
+    {
+        lower = {std::min(lower.x, other.lower.x), std::min(lower.y, other.lower.y),
+                 std::min(lower.z, other.lower.z)};
+        upper = {std::max(upper.x, other.upper.x), std::max(upper.y, other.upper.y),
+                 std::max(upper.z, other.upper.z)};
+    }
+
+    constexpr void expand(const vec3& point)
+    {
+        expand(aabb{point, point});
+    }
+
+    constexpr vec3 centre() const
+    {
+        return real_t{0.5} * (lower + upper);
+    }
+
+    constexpr real_t surface_area() const
+    {
+        const vec3 d = upper - lower;
+        return d.x < 0 ? 0 : 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+// A rigid transform with uniform scaling, mapping object space to world space
+// as p -> translation + scale * (rotation * p). Since the rotation is
+// orthonormal, unit vectors stay unit vectors in both directions, and
+// distances scale by exactly `scale`.
+struct transform {
+    vec3 x_axis{1.0, 0.0, 0.0}; // columns of the rotation
+    vec3 y_axis{0.0, 1.0, 0.0};
+    vec3 z_axis{0.0, 0.0, 1.0};
+    real_t scale = 1.0;
+    vec3 translation{};
+
+    // A rotation by angle radians about the y axis, given by its sine and
+    // cosine (so that this stays usable in constant expressions)
+    static constexpr transform rotate_y(real_t sin_a, real_t cos_a)
+    {
+        return {{cos_a, 0.0, -sin_a}, {0.0, 1.0, 0.0}, {sin_a, 0.0, cos_a}, 1.0, {}};
+    }
+
+    constexpr vec3 to_world_dir(const vec3& v) const
+    {
+        return (v.x * x_axis) + ((v.y * y_axis) + (v.z * z_axis));
+    }
+
+    constexpr vec3 to_object_dir(const vec3& v) const
+    {
+        return {dot(v, x_axis), dot(v, y_axis), dot(v, z_axis)};
+    }
+
+    constexpr vec3 to_world_point(const vec3& p) const
+    {
+        return translation + (scale * to_world_dir(p));
+    }
+
+    constexpr vec3 to_object_point(const vec3& p) const
+    {
+        return to_object_dir((real_t{1.0} / scale) * (p - translation));
+    }
+
+    constexpr aabb to_world(const aabb& box) const
+    {
+        aabb res = aabb::empty();
+        for (int i = 0; i < 8; i++) {
+            res.expand(to_world_point({(i & 1) ? box.upper.x : box.lower.x,
+                                       (i & 2) ? box.upper.y : box.lower.y,
+                                       (i & 4) ? box.upper.z : box.lower.z}));
+        }
+        return res;
+    }
 };
 
-constexpr color scale(real_t k, const color& v)
+template <typename T>
+struct basic_color {
+    T r;
+    T g;
+    T b;
+
+    constexpr basic_color() = default;
+
+    constexpr basic_color(T r, T g, T b) : r{r}, g{g}, b{b} {}
+
+    // Converts from another precision
+    template <typename U>
+    constexpr explicit basic_color(const basic_color<U>& other)
+            : r(T(other.r)), g(T(other.g)), b(T(other.b))
+    {}
+
+    static constexpr basic_color white() { return { 1.0, 1.0, 1.0 }; }
+    static constexpr basic_color grey() { return { 0.5, 0.5, 0.5 }; }
+    static constexpr basic_color black() { return {}; };
+    static constexpr basic_color background() { return black(); }
+    static constexpr basic_color default_color() { return black(); }
+};
+
+using color = basic_color<real_t>;
+
+template <typename T>
+constexpr basic_color<T> scale(detail::type_identity_t<T> k, const basic_color<T>& v)
 {
     return { k * v.r, k * v.g, k * v.b };
 }
 
-constexpr color operator+(const color& v1, const color& v2)
+template <typename T>
+constexpr basic_color<T> operator+(const basic_color<T>& v1, const basic_color<T>& v2)
 {
     return { v1.r + v2.r, v1.g + v2.g, v1.b + v2.b };
 }
 
-constexpr color operator*(const color& v1, const color& v2)
+template <typename T>
+constexpr basic_color<T> operator*(const basic_color<T>& v1, const basic_color<T>& v2)
 {
     return {v1.r * v2.r, v1.g * v2.g, v1.b * v2.b};
 }
@@ -170,14 +334,46 @@ struct camera {
     {}
 };
 
-struct ray {
-    vec3 start;
-    vec3 dir;
+template <typename T>
+struct basic_ray {
+    basic_vec3<T> start;
+    basic_vec3<T> dir;
 };
 
+using ray = basic_ray<real_t>;
+
 struct light {
     vec3 pos;
     color col;
+    // A light with finite range has its intensity fall off smoothly to zero
+    // at that distance, so it can be ignored beyond it
+    real_t range = std::numeric_limits<real_t>::infinity();
+
+    constexpr bool has_range() const
+    {
+        return range < std::numeric_limits<real_t>::infinity();
+    }
+
+    // The fraction of the light's intensity which reaches a point dist2
+    // (the squared distance) away
+    constexpr real_t falloff(real_t dist2) const
+    {
+        if (!has_range()) {
+            return 1.0;
+        }
+        const real_t k = dist2 / (range * range);
+        return k >= 1 ? real_t{0.0} : (1 - k) * (1 - k);
+    }
+
+    // Returns this light as seen from p, with its colour scaled by falloff
+    constexpr light attenuated_at(const vec3& p) const
+    {
+        if (!has_range()) {
+            return *this;
+        }
+        const vec3 d = pos - p;
+        return {pos, scale(falloff(dot(d, d)), col), range};
+    }
 };
 
 struct surface {
@@ -193,10 +389,20 @@ struct surface {
 
 struct any_thing;
 
+// The distance returned by intersection tests which miss
+constexpr real_t no_hit = std::numeric_limits<real_t>::infinity();
+
+// The closest hit along a ray. The ray itself is not stored, since whoever
+// asked for the intersection already has it; this keeps the record small
+// enough that closest-hit loops can keep it in registers.
 struct intersection {
-    const any_thing* thing_;
-    ray ray_;
-    real_t dist;
+    const any_thing* thing_ = nullptr;
+    // For things hit through an instance, the instance's transform, in
+    // which case thing_ is in object space while dist is in world space
+    const transform* xform_ = nullptr;
+    real_t dist = no_hit;
+
+    constexpr explicit operator bool() const { return thing_ != nullptr; }
 };
 
 struct sphere {
@@ -211,24 +417,32 @@ public:
               surface_{surface_}
     {}
 
-    constexpr
-    std::optional<intersection> intersect(const any_thing* pself, const ray& ray_) const
+    // Returns the distance to where the ray enters the sphere, or to where it
+    // leaves if it starts inside
+    constexpr real_t intersect(const ray& ray_) const
     {
         const vec3 eo = centre - ray_.start;
         const auto v = dot(eo, ray_.dir);
-        real_t dist = 0;
+        if (v < 0 && dot(eo, eo) >= radius2) {
+            return no_hit;
+        }
 
-        if (v >= 0) {
-            auto disc = radius2 - (dot(eo, eo) - v * v);
-            if (disc >= 0) {
-                dist = v - cmath::sqrt(disc);
-            }
+        // The squared distance from the centre to the ray, found from the
+        // perpendicular rather than as dot(eo, eo) - v * v, which cancels
+        // catastrophically for small, distant spheres
+        const vec3 perp = eo - v * ray_.dir;
+        const auto disc = radius2 - dot(perp, perp);
+        if (disc < 0) {
+            return no_hit;
         }
-        if (dist == 0.0) {
-            return std::nullopt;
-        } else {
-            return intersection{pself, ray_, dist};
+        // The ray starts outside the sphere exactly when v exceeds half the
+        // chord
+        const auto half_chord = cmath::sqrt(disc);
+        if (v > half_chord) {
+            return v - half_chord;
         }
+        const auto exit = v + half_chord;
+        return exit > 0 ? exit : no_hit;
     }
 
     constexpr vec3 get_normal(const vec3& pos) const
@@ -236,6 +450,17 @@ public:
         return norm(pos - centre);
     }
 
+    constexpr void translate(const vec3& delta)
+    {
+        centre = centre + delta;
+    }
+
+    constexpr std::optional<aabb> get_bounds() const
+    {
+        const real_t r = cmath::sqrt(radius2);
+        return aabb{centre - vec3{r, r, r}, centre + vec3{r, r, r}};
+    }
+
     constexpr const surface& get_surface() const
     {
         return surface_;
@@ -247,15 +472,16 @@ struct plane {
     real_t offset;
     surface surface_;
 
-    constexpr
-    std::optional<intersection> intersect(const any_thing* pself, const ray& ray_) const
+    // Only rays which start in front of the plane and head towards it hit
+    // it; anything else would be a hit behind the ray's start, or none
+    constexpr real_t intersect(const ray& ray_) const
     {
-        const auto denom = dot(norm, ray_.dir);
-        if (denom > 0) {
-            return std::nullopt;
+        const auto speed = -dot(norm, ray_.dir);
+        const auto height = dot(norm, ray_.start) + offset;
+        if (speed <= 0 || height < 0) {
+            return no_hit;
         } else {
-            real_t dist = (dot(norm, ray_.start) + offset) / (-denom);
-            return intersection{ pself, ray_, dist };
+            return height / speed;
         }
     }
 
@@ -264,6 +490,17 @@ struct plane {
         return norm;
     }
 
+    constexpr void translate(const vec3& delta)
+    {
+        offset -= dot(norm, delta);
+    }
+
+    // Planes are infinite, so have no bounding box
+    constexpr std::optional<aabb> get_bounds() const
+    {
+        return std::nullopt;
+    }
+
     constexpr const surface& get_surface() const
     {
         return surface_;
@@ -271,13 +508,15 @@ struct plane {
 };
 
 struct any_thing {
-    template <typename T>
+    template <typename T,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<T>, any_thing>>>
     constexpr any_thing(T&& t) : item_(std::forward<T>(t)) {}
 
-    constexpr std::optional<intersection> intersect(const ray& ray_) const
+    // Returns the distance along the ray to the thing, or no_hit
+    constexpr real_t intersect(const ray& ray_) const
     {
         return std::visit([&](const auto& thing) -> decltype(auto) {
-            return thing.intersect(this, ray_);
+            return thing.intersect(ray_);
         }, item_);
     }
 
@@ -295,6 +534,23 @@ struct any_thing {
         }, item_);
     }
 
+    constexpr void translate(const vec3& delta)
+    {
+        std::visit([&](auto& thing) { thing.translate(delta); }, item_);
+    }
+
+    constexpr std::optional<aabb> get_bounds() const
+    {
+        return std::visit([](const auto& thing_) { return thing_.get_bounds(); }, item_);
+    }
+
+    // Calls func with the concrete thing, e.g. to serialise it
+    template <typename Func>
+    constexpr decltype(auto) visit(Func&& func) const
+    {
+        return std::visit(std::forward<Func>(func), item_);
+    }
+
 private:
     std::variant<sphere, plane> item_;
 };
@@ -329,75 +585,378 @@ inline constexpr surface checkerboard{
 
 } // end namespace surfaces
 
+// A rectangular block of pixels within an image
+struct tile {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Generates primary ray directions for a width x height image.
+//
+// The image plane offsets between neighbouring pixels are computed once per
+// frame, so that the unnormalised direction for a pixel is just a row base plus
+// a multiple of the per-column delta. Directions are produced in batches of
+// batch_size, with the normalisation done over the whole batch in separate
+// loops so that the compiler can vectorise it.
+class camera_ray_generator {
+public:
+    static constexpr int batch_size = 8;
+
+    constexpr camera_ray_generator(const camera& cam, int width, int height)
+            : origin_{cam.pos},
+              // Pixel (0, 0) maps to forward - right/4 + up/4
+              base_{cam.forward + ((real_t{-0.25} * cam.right) + (real_t{0.25} * cam.up))},
+              dx_{(real_t{0.5} / width) * cam.right},
+              dy_{(real_t{-0.5} / height) * cam.up}
+    {}
+
+    constexpr const vec3& get_origin() const { return origin_; }
+
+    constexpr vec3 get_direction(int x, int y) const
+    {
+        return norm(base_ + ((real_t(x) * dx_) + (real_t(y) * dy_)));
+    }
+
+    // Writes the normalised directions for count pixels of row y, starting at
+    // column x and advancing step columns at a time, to out[0..count)
+    constexpr void generate_row(int x, int y, int count, int step, vec3* out) const
+    {
+        const vec3 row_base = base_ + (real_t(y) * dy_);
+        const vec3 delta = real_t(step) * dx_;
+        while (count > 0) {
+            const int n = std::min(count, batch_size);
+            generate_batch(row_base + (real_t(x) * dx_), delta, n, out);
+            x += n * step;
+            out += n;
+            count -= n;
+        }
+    }
+
+    // Writes the normalised directions for every step'th pixel of tile_, in
+    // row-major order, to out, which must have room for
+    // ceil(width/step) * ceil(height/step) elements
+    constexpr void generate_tile(const tile& tile_, int step, vec3* out) const
+    {
+        const int cols = (tile_.width + step - 1) / step;
+        for (int y = tile_.y; y < tile_.y + tile_.height; y += step) {
+            generate_row(tile_.x, y, cols, step, out);
+            out += cols;
+        }
+    }
+
+private:
+    static constexpr void generate_batch(const vec3& start, const vec3& delta, int n, vec3* out)
+    {
+        real_t xs[batch_size]{};
+        real_t ys[batch_size]{};
+        real_t zs[batch_size]{};
+        real_t inv_len[batch_size]{};
+
+        vec3 p = start;
+        for (int i = 0; i < batch_size; i++) {
+            xs[i] = p.x;
+            ys[i] = p.y;
+            zs[i] = p.z;
+            p = p + delta;
+        }
+        for (int i = 0; i < batch_size; i++) {
+            inv_len[i] = real_t{1.0} / cmath::sqrt(xs[i] * xs[i] + ys[i] * ys[i] + zs[i] * zs[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            out[i] = {xs[i] * inv_len[i], ys[i] * inv_len[i], zs[i] * inv_len[i]};
+        }
+    }
+
+    vec3 origin_;
+    vec3 base_;
+    vec3 dx_;
+    vec3 dy_;
+};
+
+// Adapts a Canvas so that writes to pixel (x, y) go to pixel (x + dx, y + dy)
+// of the underlying canvas
+template <typename Canvas>
+struct offset_canvas {
+    Canvas& canvas;
+    int dx;
+    int dy;
+
+    constexpr void set_pixel(int x, int y, const color& col)
+    {
+        canvas.set_pixel(x + dx, y + dy, col);
+    }
+};
+
+// A stop token which never requests a stop, for renders which always run to
+// completion
+struct never_stop {
+    constexpr bool stop_requested() const { return false; }
+};
+
+namespace detail {
+
+// Detects whether a Scene provides its own intersect(ray) member, e.g. using
+// an acceleration structure, rather than only get_things()
+template <typename Scene, typename = void>
+struct has_intersect : std::false_type {};
+
+template <typename Scene>
+struct has_intersect<Scene, std::void_t<decltype(std::declval<const Scene&>().intersect(std::declval<const ray&>()))>>
+        : std::true_type {};
+
+// Detects whether a Scene provides an intersect_any(ray, max_dist) member,
+// which finds something hit by the ray closer than max_dist (not
+// necessarily the closest), for shadow rays
+template <typename Scene, typename = void>
+struct has_intersect_any : std::false_type {};
+
+template <typename Scene>
+struct has_intersect_any<Scene, std::void_t<decltype(std::declval<const Scene&>().intersect_any(
+        std::declval<const ray&>(), std::declval<real_t>()))>>
+        : std::true_type {};
+
+struct light_visitor {
+    constexpr void operator()(const light&) const {}
+};
+
+// Detects whether a Scene provides a for_each_light(pos, func) member which
+// calls func with only the lights which matter at pos, e.g. using a light
+// tree, rather than only get_lights()
+template <typename Scene, typename = void>
+struct has_light_query : std::false_type {};
+
+template <typename Scene>
+struct has_light_query<Scene, std::void_t<decltype(std::declval<const Scene&>().for_each_light(
+        std::declval<const vec3&>(), std::declval<light_visitor>()))>>
+        : std::true_type {};
+
+// Detects whether a Canvas can take a run of pixels at once, through a
+// set_pixels(x, y, colors, count) member
+template <typename Canvas, typename = void>
+struct has_set_pixels : std::false_type {};
+
+template <typename Canvas>
+struct has_set_pixels<Canvas, std::void_t<decltype(std::declval<Canvas&>().set_pixels(
+        0, 0, std::declval<const color*>(), 0))>>
+        : std::true_type {};
+
+} // end namespace detail
+
+// Remembers, for each light, the last thing found to block it, so that the
+// next shadow ray towards that light (usually from a neighbouring pixel) can
+// test that thing before searching the whole scene. The cache only changes
+// how quickly a shadow is found, not whether it is (bar rounding noise for
+// shading points tens of thousands of units away).
+//
+// The cache holds pointers to the occluding things, which it dereferences on
+// the next lookup, so it must be clear()ed before it is used with another
+// scene, or after things are added to or removed from its scene (moving
+// things in place is fine). A cache is not thread-safe: give each thread its
+// own.
+class shadow_cache {
+public:
+    struct stats {
+        std::uint64_t tests = 0;    // shadow rays cast
+        std::uint64_t occluded = 0; // of which were blocked
+        std::uint64_t hits = 0;     // of which were resolved by the cached occluder
+    };
+
+    constexpr const stats& get_stats() const { return stats_; }
+
+    // Adds the counts from another cache's statistics to this one's, e.g. to
+    // total up the caches of several threads
+    constexpr void add_stats(const stats& other)
+    {
+        stats_.tests += other.tests;
+        stats_.occluded += other.occluded;
+        stats_.hits += other.hits;
+    }
+
+    // Forgets the cached occluders and resets the statistics
+    constexpr void clear() { *this = shadow_cache{}; }
+
+private:
+    friend class ray_tracer;
+
+    static constexpr int n_slots = 64;
+
+    struct slot {
+        vec3 light_pos{};
+        int depth = 0;
+        const any_thing* thing_ = nullptr;
+        const transform* xform_ = nullptr;
+    };
+
+    // Lights are identified by their position
+    static constexpr int get_slot(const vec3& light_pos, int depth)
+    {
+        const auto quantise = [](real_t v) {
+            return std::uint32_t(std::int32_t(std::clamp<real_t>(v * 1024, -1e9, 1e9)));
+        };
+        return int((quantise(light_pos.x) * 73856093u ^ quantise(light_pos.y) * 19349663u ^
+                    quantise(light_pos.z) * 83492791u ^ std::uint32_t(depth) * 2654435761u) % n_slots);
+    }
+
+    slot slots_[n_slots]{};
+    stats stats_{};
+};
+
+class wavefront_tracer;
+
 class ray_tracer {
 private:
+    // The wavefront tracer reuses the intersection and shading steps below,
+    // but schedules them breadth-first
+    friend class wavefront_tracer;
+
     int max_depth = 5;
+    shadow_cache* shadow_cache_ = nullptr;
 
     template <typename Scene>
-    constexpr std::optional<intersection> get_intersections(const ray& ray_, const Scene& scene_) const
+    constexpr intersection get_intersections(const ray& ray_, const Scene& scene_) const
     {
-        auto closest_dist = std::numeric_limits<real_t>::max();
-        std::optional<intersection> closest_inter{};
+        if constexpr (detail::has_intersect<Scene>::value) {
+            return scene_.intersect(ray_);
+        } else {
+            intersection closest{};
 
-        for (const auto& t : scene_.get_things()) {
-            if (auto inter = t.intersect(ray_); inter && (*inter).dist < closest_dist) {
-                closest_dist = (*inter).dist;
-                closest_inter = std::move(inter);
+            for (const auto& t : scene_.get_things()) {
+                if (const real_t dist = t.intersect(ray_); dist < closest.dist) {
+                    closest = {&t, nullptr, dist};
+                }
             }
-        }
 
-        return closest_inter;
+            return closest;
+        }
     }
 
+    // Finds something the ray hits closer than max_dist, or returns an
+    // empty intersection if nothing does
     template <typename Scene>
-    constexpr std::optional<real_t> test_ray(const ray& ray_, const Scene& scene_) const
+    constexpr intersection find_occluder(const ray& ray_, real_t max_dist, const Scene& scene_) const
     {
-        if (const auto isect = get_intersections(ray_, scene_); isect) {
-            return isect->dist;
+        if constexpr (detail::has_intersect_any<Scene>::value) {
+            return scene_.intersect_any(ray_, max_dist);
+        } else {
+            const auto isect = get_intersections(ray_, scene_);
+            return isect.dist < max_dist ? isect : intersection{};
         }
-        return std::nullopt;
     }
 
     template <typename Scene>
     constexpr color trace_ray(const ray& ray_, const Scene& scene_, int depth) const
     {
         if (const auto isect = get_intersections(ray_, scene_); isect) {
-            return shade(*isect, scene_, depth);
+            return shade(isect, ray_, scene_, depth);
         }
         return color::background();
     }
 
+    static constexpr vec3 get_normal(const intersection& isect, const vec3& pos)
+    {
+        return isect.xform_
+                ? isect.xform_->to_world_dir(isect.thing_->get_normal(isect.xform_->to_object_point(pos)))
+                : isect.thing_->get_normal(pos);
+    }
+
+    // Returns a ray along dir from just off the surface at pos, on the side
+    // which dir leaves by, so that rounding error in pos can't make the ray
+    // hit the surface it starts from. Rounding error grows with distance
+    // from the origin, and so does the offset. It is sized for float even
+    // in double builds, so that their images still match float ones.
+    static constexpr ray leaving_ray(const vec3& pos, const vec3& normal, const vec3& dir)
+    {
+        const auto abs = [](real_t v) { return v < 0 ? -v : v; };
+        const real_t extent = std::max({abs(pos.x), abs(pos.y), abs(pos.z), real_t{1}});
+        const real_t offset = real_t(128 * std::numeric_limits<float>::epsilon()) * extent;
+        return {pos + (dot(dir, normal) < 0 ? -offset : offset) * normal, dir};
+    }
+
     template <typename Scene>
-    constexpr color shade(const intersection& isect, const Scene& scene, int depth) const
+    constexpr color shade(const intersection& isect, const ray& ray_, const Scene& scene, int depth) const
     {
-        const vec3& d = isect.ray_.dir;
-        const vec3 pos = (isect.dist * d) + isect.ray_.start;
-        const vec3 normal = isect.thing_->get_normal(pos);
+        const vec3& d = ray_.dir;
+        const vec3 pos = (isect.dist * d) + ray_.start;
+        const vec3 normal = get_normal(isect, pos);
         const vec3 reflect_dir = d - (2 * (dot(normal, d) * normal));
-        const color natural_color = color::background() + get_natural_color(*isect.thing_, pos, normal, reflect_dir, scene);
-        const color reflected_color = depth >= max_depth ? color::grey() : get_reflection_color(*isect.thing_, pos, reflect_dir, scene, depth);
+        const color natural_color = color::background() + get_natural_color(*isect.thing_, pos, normal, reflect_dir, scene, depth);
+        const color reflected_color = depth >= max_depth ? color::grey() : get_reflection_color(*isect.thing_, pos, normal, reflect_dir, scene, depth);
         return natural_color + reflected_color;
     }
 
     template <typename Scene>
-    constexpr color get_reflection_color(const any_thing& thing_, const vec3& pos,
+    constexpr color get_reflection_color(const any_thing& thing_, const vec3& pos, const vec3& normal,
                                          const vec3& rd, const Scene& scene, int depth) const
     {
-        return scale(thing_.get_surface().reflect(pos), trace_ray({pos, rd }, scene, depth + 1));
+        return scale(thing_.get_surface().reflect(pos), trace_ray(leaving_ray(pos, normal, rd), scene, depth + 1));
     }
 
     template <typename Scene>
     constexpr color add_light(const any_thing& thing, const vec3& pos, const vec3& normal,
                               const vec3& rd, const Scene& scene, const color& col,
-                              const light& light_) const
+                              const light& light_, int depth) const
     {
+        // A light which has fallen off to nothing doesn't need a shadow ray
+        if (light_.col.r == 0 && light_.col.g == 0 && light_.col.b == 0) {
+            return col;
+        }
         const vec3 ldis = light_.pos - pos;
         const vec3 livec = norm(ldis);
-        const auto near_isect = test_ray({pos, livec}, scene);
-        const bool is_in_shadow = near_isect ? *near_isect < mag(ldis) : false;
-        if (is_in_shadow) {
+        // A light behind the surface is hidden by the thing itself
+        if (dot(livec, normal) <= 0 ||
+                is_in_shadow(leaving_ray(pos, normal, livec), mag(ldis), light_.pos, scene, depth)) {
             return col;
         }
+        return add_unshadowed_light(thing, pos, normal, rd, col, light_, livec);
+    }
+
+    // Returns true if something blocks shadow_ray before it reaches the light
+    // light_dist away. The depth is that of the ray whose hit is being lit;
+    // neighbouring pixels' rays at the same depth tend to hit nearby points,
+    // so the shadow cache keeps separate occluders for each depth.
+    template <typename Scene>
+    constexpr bool is_in_shadow(const ray& shadow_ray, real_t light_dist, const vec3& light_pos,
+                                const Scene& scene, int depth) const
+    {
+        if (!shadow_cache_) {
+            return bool(find_occluder(shadow_ray, light_dist, scene));
+        }
+
+        auto& cache = *shadow_cache_;
+        auto& slot = cache.slots_[shadow_cache::get_slot(light_pos, depth)];
+        cache.stats_.tests++;
+
+        // Anything closer than the light casts a shadow, so if the last
+        // occluder still blocks the ray there's no need to find the nearest
+        if (slot.thing_ && slot.depth == depth && slot.light_pos.x == light_pos.x &&
+                slot.light_pos.y == light_pos.y && slot.light_pos.z == light_pos.z) {
+            const real_t dist = slot.xform_
+                    ? slot.thing_->intersect({slot.xform_->to_object_point(shadow_ray.start),
+                                              slot.xform_->to_object_dir(shadow_ray.dir)}) * slot.xform_->scale
+                    : slot.thing_->intersect(shadow_ray);
+            if (dist < light_dist) {
+                cache.stats_.hits++;
+                cache.stats_.occluded++;
+                return true;
+            }
+        }
+
+        if (const auto isect = find_occluder(shadow_ray, light_dist, scene)) {
+            cache.stats_.occluded++;
+            slot = {light_pos, depth, isect.thing_, isect.xform_};
+            return true;
+        }
+        return false;
+    }
+
+    // Adds the light's contribution to col, given that it is known to reach
+    // pos from direction livec
+    constexpr color add_unshadowed_light(const any_thing& thing, const vec3& pos, const vec3& normal,
+                                         const vec3& rd, const color& col, const light& light_,
+                                         const vec3& livec) const
+    {
         const auto illum = dot(livec, normal);
         const auto lcolor = (illum > 0) ? scale(illum, light_.col) : color::default_color();
         const auto specular = dot(livec, norm(rd));
@@ -409,33 +968,148 @@ private:
 
     template <typename Scene>
     constexpr color get_natural_color(const any_thing& thing, const vec3& pos,
-                                      const vec3& norm_, const vec3& rd, const Scene& scene) const
+                                      const vec3& norm_, const vec3& rd, const Scene& scene,
+                                      int depth) const
     {
         color col = color::default_color();
-        for (const auto& light : scene.get_lights()) {
-            col = add_light(thing, pos, norm_, rd, scene, col, light);
-        }
+        for_each_light(scene, pos, [&](const light& light_) {
+            col = add_light(thing, pos, norm_, rd, scene, col, light_, depth);
+        });
         return col;
     }
 
-    constexpr vec3 get_point(int width, int height, int x, int y, const camera& cam) const
+    // Calls func with each light which illuminates pos, attenuated by its
+    // falloff (and any other weighting the scene's light query applies)
+    template <typename Scene, typename Func>
+    static constexpr void for_each_light(const Scene& scene, const vec3& pos, Func&& func)
     {
-        const auto recenterX =  (x - (width / 2.0)) / 2.0 / width;
-        const auto recenterY = -(y - (height / 2.0)) / 2.0 / height;
-        return norm(cam.forward + ((recenterX * cam.right) + (recenterY * cam.up)));
+        if constexpr (detail::has_light_query<Scene>::value) {
+            scene.for_each_light(pos, func);
+        } else {
+            for (const auto& light_ : scene.get_lights()) {
+                func(light_.attenuated_at(pos));
+            }
+        }
     }
 
 public:
+    constexpr ray_tracer() = default;
+
+    constexpr explicit ray_tracer(int max_depth)
+            : max_depth{max_depth}
+    {}
+
+    // Returns a copy of this tracer which uses the given shadow cache. The
+    // cache must outlive the copy, be used by only one thread at a time, and
+    // be cleared before the copy renders a different scene (see
+    // shadow_cache).
+    constexpr ray_tracer with_shadow_cache(shadow_cache& cache) const
+    {
+        ray_tracer copy = *this;
+        copy.shadow_cache_ = &cache;
+        return copy;
+    }
+
+    constexpr shadow_cache* get_shadow_cache() const { return shadow_cache_; }
+
+    // Returns a copy of this tracer which follows reflections to at most the
+    // given depth
+    constexpr ray_tracer with_max_depth(int depth) const
+    {
+        ray_tracer copy = *this;
+        copy.max_depth = depth;
+        return copy;
+    }
+
+    constexpr int get_max_depth() const { return max_depth; }
+
+    // Renders the pixels of tile_ onto the canvas. If step is greater than one,
+    // only every step'th pixel in each direction is traced, and its colour is
+    // used for the whole step x step block.
+    template <typename Scene, typename Canvas>
+    constexpr void render_tile(const Scene& scene, Canvas& canvas, int width, int height,
+                               const tile& tile_, int step = 1) const
+    {
+        const int x_end = tile_.x + tile_.width;
+        const int y_end = tile_.y + tile_.height;
+        const camera_ray_generator gen{scene.get_camera(), width, height};
+        vec3 dirs[camera_ray_generator::batch_size]{};
+
+        for (int y = tile_.y; y < y_end; y += step) {
+            for (int x = tile_.x; x < x_end; x += step * camera_ray_generator::batch_size) {
+                const int count = std::min(camera_ray_generator::batch_size, (x_end - x + step - 1) / step);
+                gen.generate_row(x, y, count, step, dirs);
+                if constexpr (detail::has_set_pixels<Canvas>::value) {
+                    if (step == 1) {
+                        color colors[camera_ray_generator::batch_size]{};
+                        for (int i = 0; i < count; i++) {
+                            colors[i] = trace_ray({ gen.get_origin(), dirs[i] }, scene, 0);
+                        }
+                        canvas.set_pixels(x, y, colors, count);
+                        continue;
+                    }
+                }
+                for (int i = 0; i < count; i++) {
+                    const int px = x + i * step;
+                    const auto color = trace_ray({ gen.get_origin(), dirs[i] }, scene, 0);
+                    for (int by = y; by < std::min(y + step, y_end); by++) {
+                        for (int bx = px; bx < std::min(px + step, x_end); bx++) {
+                            canvas.set_pixel(bx, by, color);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
     template <typename Scene, typename Canvas>
     constexpr void render(const Scene& scene, Canvas& canvas, int width, int height) const
     {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                const auto point = get_point(width, height, x, y, scene.get_camera());
-                const auto color = trace_ray({ scene.get_camera().pos, point }, scene, 0);
-                canvas.set_pixel(x, y, color);
+        render_tile(scene, canvas, width, height, {0, 0, width, height});
+    }
+
+    // Renders only the crop rectangle of a width x height image, using the same
+    // camera mapping as a full-frame render. Pixel (crop.x, crop.y) of the
+    // image is written to (dest_x, dest_y) of the canvas, so the canvas may
+    // either be the size of the crop or a larger image being updated in place.
+    // The crop is clipped to the image bounds.
+    template <typename Scene, typename Canvas>
+    constexpr void render_crop(const Scene& scene, Canvas& canvas, int width, int height,
+                               const tile& crop, int dest_x = 0, int dest_y = 0) const
+    {
+        const int x0 = std::max(crop.x, 0);
+        const int y0 = std::max(crop.y, 0);
+        const int x1 = std::min(crop.x + crop.width, width);
+        const int y1 = std::min(crop.y + crop.height, height);
+        if (x1 <= x0 || y1 <= y0) {
+            return;
+        }
+
+        offset_canvas<Canvas> target{canvas, dest_x - crop.x, dest_y - crop.y};
+        render_tile(scene, target, width, height, {x0, y0, x1 - x0, y1 - y0});
+    }
+
+    // Renders the image in tile_size x tile_size tiles, in row-major order.
+    // Before each tile is started, stop.stop_requested() is checked, and the
+    // render is abandoned if it returns true. After each tile is completed,
+    // on_tile(tile) is called. Returns true if every tile was rendered.
+    template <typename Scene, typename Canvas, typename StopToken, typename TileFunc>
+    constexpr bool render(const Scene& scene, Canvas& canvas, int width, int height,
+                          const StopToken& stop, TileFunc&& on_tile,
+                          int tile_size = 32, int step = 1) const
+    {
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                if (stop.stop_requested()) {
+                    return false;
+                }
+                const tile tile_{x, y, std::min(tile_size, width - x),
+                                 std::min(tile_size, height - y)};
+                render_tile(scene, canvas, width, height, tile_, step);
+                on_tile(tile_);
             }
         }
+        return true;
     }
 };
 
@@ -0,0 +1,283 @@
+
+/*
+ * Run-time render control: cancellation, deadlines and progressive rendering
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+using render_clock = std::chrono::steady_clock;
+
+// A stop token in the style of C++20's std::stop_token, which additionally
+// requests a stop once its deadline (if any) has passed
+class stop_token {
+public:
+    stop_token() = default;
+
+    bool stop_requested() const
+    {
+        return (state_ && state_->load(std::memory_order_relaxed)) ||
+                render_clock::now() >= deadline_;
+    }
+
+    // Returns a copy of this token which also requests a stop at deadline
+    stop_token with_deadline(render_clock::time_point deadline) const
+    {
+        stop_token tok = *this;
+        tok.deadline_ = std::min(deadline_, deadline);
+        return tok;
+    }
+
+    render_clock::time_point get_deadline() const { return deadline_; }
+
+private:
+    friend class stop_source;
+
+    explicit stop_token(std::shared_ptr<const std::atomic<bool>> state)
+            : state_{std::move(state)}
+    {}
+
+    std::shared_ptr<const std::atomic<bool>> state_;
+    render_clock::time_point deadline_ = render_clock::time_point::max();
+};
+
+class stop_source {
+public:
+    void request_stop() { state_->store(true, std::memory_order_relaxed); }
+
+    bool stop_requested() const { return state_->load(std::memory_order_relaxed); }
+
+    stop_token get_token() const { return stop_token{state_}; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> state_ = std::make_shared<std::atomic<bool>>(false);
+};
+
+namespace detail {
+
+// A scene seen through a different camera, so that several renders can view
+// one scene from different places at the same time. intersect(),
+// intersect_any() and for_each_light() are only provided if the underlying
+// scene provides them.
+template <typename Scene>
+struct camera_view {
+    const Scene& scene;
+    camera cam;
+
+    const camera& get_camera() const { return cam; }
+
+    decltype(auto) get_things() const { return scene.get_things(); }
+
+    decltype(auto) get_lights() const { return scene.get_lights(); }
+
+    template <typename S = Scene>
+    auto intersect(const ray& ray_) const -> decltype(std::declval<const S&>().intersect(ray_))
+    {
+        return scene.intersect(ray_);
+    }
+
+    template <typename S = Scene>
+    auto intersect_any(const ray& ray_, real_t max_dist) const
+            -> decltype(std::declval<const S&>().intersect_any(ray_, max_dist))
+    {
+        return scene.intersect_any(ray_, max_dist);
+    }
+
+    template <typename Func, typename S = Scene>
+    auto for_each_light(const vec3& pos, Func&& func) const
+            -> decltype(std::declval<const S&>().for_each_light(pos, func))
+    {
+        return scene.for_each_light(pos, func);
+    }
+};
+
+} // end namespace detail
+
+// Records which tiles of an image have been rendered, and at what quality.
+// Each tile stores the pixel step it was rendered with (1 being full
+// resolution), or zero if it has not been rendered.
+class completion_map {
+public:
+    completion_map(int width, int height, int tile_size)
+            : tile_size_{tile_size},
+              tiles_x_{(width + tile_size - 1) / tile_size},
+              tiles_y_{(height + tile_size - 1) / tile_size},
+              steps_(tiles_x_ * tiles_y_)
+    {}
+
+    void mark(const tile& tile_, int step)
+    {
+        steps_[tile_.x / tile_size_ + tiles_x_ * (tile_.y / tile_size_)] = step;
+    }
+
+    int get_step(int tile_x, int tile_y) const { return steps_[tile_x + tiles_x_ * tile_y]; }
+
+    bool is_complete(int tile_x, int tile_y) const { return get_step(tile_x, tile_y) != 0; }
+
+    bool all_complete() const
+    {
+        return std::all_of(steps_.begin(), steps_.end(), [](int s) { return s != 0; });
+    }
+
+    // Returns true if every tile has been rendered at full resolution
+    bool all_full_quality() const
+    {
+        return std::all_of(steps_.begin(), steps_.end(), [](int s) { return s == 1; });
+    }
+
+    int get_tile_size() const { return tile_size_; }
+    int get_tiles_x() const { return tiles_x_; }
+    int get_tiles_y() const { return tiles_y_; }
+
+private:
+    int tile_size_;
+    int tiles_x_;
+    int tiles_y_;
+    std::vector<int> steps_;
+};
+
+// The (possibly partial) result of a cancellable render
+template <typename Canvas>
+struct render_result {
+    Canvas canvas;
+    completion_map completed;
+};
+
+// Renders the scene tile-by-tile into a new width x height Canvas, stopping
+// at the next tile boundary once stop requests it. Tiles which were not
+// reached are left as the Canvas's initial contents.
+template <typename Canvas, typename Scene>
+render_result<Canvas> render_cancellable(const ray_tracer& tracer, const Scene& scene,
+                                         int width, int height, const stop_token& stop,
+                                         int tile_size = 32)
+{
+    render_result<Canvas> res{Canvas{width, height}, completion_map{width, height, tile_size}};
+    tracer.render(scene, res.canvas, width, height, stop,
+                  [&](const tile& t) { res.completed.mark(t, 1); }, tile_size);
+    return res;
+}
+
+// Renders the best image it can within the given time budget.
+//
+// The image is rendered progressively with the given tracer: first at 1/8th
+// resolution with a single bounce, then refined at 1/4 and 1/2 resolution,
+// and finally at full resolution and the tracer's full ray depth. Each pass
+// overwrites the tiles of the previous one as they finish, so if the
+// deadline passes part-way through a pass the result mixes tiles of two
+// adjacent quality levels; the returned completion map records which. The
+// coarsest pass always runs to completion (unless stop is requested) so
+// that every pixel has a value.
+template <typename Canvas, typename Scene>
+render_result<Canvas> render_within(const ray_tracer& tracer, const Scene& scene, int width, int height,
+                                    std::chrono::milliseconds budget,
+                                    const stop_token& stop = {}, int tile_size = 32)
+{
+    struct quality_level {
+        int step;
+        int max_depth; // capped at the tracer's own
+    };
+    constexpr int full_depth = std::numeric_limits<int>::max();
+    constexpr quality_level levels[] = {{8, 1}, {4, 2}, {2, full_depth}, {1, full_depth}};
+
+    const auto deadline = render_clock::now() + budget;
+    render_result<Canvas> res{Canvas{width, height}, completion_map{width, height, tile_size}};
+
+    for (const auto& level : levels) {
+        const auto level_stop = &level == levels ? stop : stop.with_deadline(deadline);
+        const int depth = std::min(level.max_depth, tracer.get_max_depth());
+        const bool finished = tracer.with_max_depth(depth).render(
+                scene, res.canvas, width, height, level_stop,
+                [&](const tile& t) { res.completed.mark(t, level.step); },
+                tile_size, level.step);
+        if (!finished) {
+            break;
+        }
+    }
+
+    return res;
+}
+
+// Renders the image on thread_count threads (counting the calling thread),
+// which take tile_size x tile_size tiles in turn until there are none left.
+//
+// The image is bit-identical whatever the number of threads and however the
+// tiles are scheduled. Each pixel is traced from scratch, by code which
+// depends only on the pixel (light sampling, for instance, draws its random
+// numbers from a hash of the shading position), and written exactly once.
+// The only state carried between pixels is the tracer's shadow cache, if it
+// has one, which could find different occluders depending on which tiles a
+// thread had rendered before; so each tile gets a fresh cache instead, whose
+// statistics are added to the tracer's cache at the end.
+//
+// The canvas must allow different pixels to be set from different threads
+// at the same time, as dynamic_canvas, hdr_canvas and half_canvas do.
+template <typename Scene, typename Canvas>
+void render_parallel(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, int width, int height,
+                     int thread_count, int tile_size = 32)
+{
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tile_count = tiles_x * ((height + tile_size - 1) / tile_size);
+    thread_count = std::max(thread_count, 1);
+    std::atomic<int> next_tile{0};
+    // Only used for their statistics
+    std::vector<shadow_cache> totals(thread_count);
+
+    const auto run = [&](int thread_index) {
+        for (int i = next_tile++; i < tile_count; i = next_tile++) {
+            const int x = (i % tiles_x) * tile_size;
+            const int y = (i / tiles_x) * tile_size;
+            const tile tile_{x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)};
+            if (tracer.get_shadow_cache()) {
+                shadow_cache cache{};
+                tracer.with_shadow_cache(cache).render_tile(scene, canvas, width, height, tile_);
+                totals[thread_index].add_stats(cache.get_stats());
+            } else {
+                tracer.render_tile(scene, canvas, width, height, tile_);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < thread_count; t++) {
+        threads.emplace_back(run, t);
+    }
+    run(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (shadow_cache* cache = tracer.get_shadow_cache()) {
+        for (const auto& t : totals) {
+            cache->add_stats(t.get_stats());
+        }
+    }
+}
+
+} // end namespace rt
@@ -0,0 +1,579 @@
+
+/*
+ * A long-running render server, and its client
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "byte_buffer.hpp"
+#include "dynamic_scene.hpp"
+#include "hdr_image.hpp"
+#include "render_control.hpp"
+#include "render_protocol.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "stb_image_write.h"
+
+namespace rt {
+
+// Keeps the most recently used scenes, decoded and with their acceleration
+// structures built, keyed by the hash of their encoding. Scenes are shared
+// with the jobs rendering them, so evicting one never pulls it out from
+// under a render. The hash is easy to collide on purpose, so each scene's
+// encoding is kept too, and a scene is only found by an upload of exactly
+// the same bytes; an upload which collides with a different cached scene is
+// refused. Thread-safe.
+class scene_cache {
+public:
+    explicit scene_cache(std::size_t capacity = 16)
+            : capacity_{capacity}
+    {}
+
+    // Returns the id of an encoded scene, decoding and building it unless an
+    // identical scene is already cached, or nullopt if it is malformed or
+    // its id is taken by a different scene
+    std::optional<std::uint64_t> insert(const std::vector<std::uint8_t>& bytes)
+    {
+        const std::uint64_t id = get_scene_hash(bytes);
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            const auto it = entries_.find(id);
+            if (it != entries_.end()) {
+                if (it->second.bytes != bytes) {
+                    return std::nullopt;
+                }
+                it->second.last_used = ++clock_;
+                return id;
+            }
+        }
+        // Built without the lock held, so other clients' jobs aren't held up
+        auto scene = decode_scene(bytes);
+        if (!scene) {
+            return std::nullopt;
+        }
+        auto ptr = std::make_shared<const dynamic_scene>(std::move(*scene));
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        // Another client may have uploaded a scene with this id meanwhile
+        if (const auto it = entries_.find(id); it != entries_.end()) {
+            return it->second.bytes == bytes ? std::optional{id} : std::nullopt;
+        }
+        entries_[id] = {std::move(ptr), bytes, ++clock_};
+        while (entries_.size() > capacity_) {
+            entries_.erase(std::min_element(entries_.begin(), entries_.end(), [](const auto& a, const auto& b) {
+                return a.second.last_used < b.second.last_used;
+            }));
+        }
+        return id;
+    }
+
+    // Returns the scene with the given id, or nullptr if it isn't cached
+    std::shared_ptr<const dynamic_scene> find(std::uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+        it->second.last_used = ++clock_;
+        return it->second.scene;
+    }
+
+    std::size_t get_size() const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return entries_.size();
+    }
+
+private:
+    struct entry {
+        std::shared_ptr<const dynamic_scene> scene;
+        // The encoding the scene was decoded from, to check uploads against
+        std::vector<std::uint8_t> bytes;
+        std::uint64_t last_used;
+    };
+
+    std::size_t capacity_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::uint64_t, entry> entries_;
+    std::uint64_t clock_ = 0;
+};
+
+// A render server listening on a Unix domain socket or TCP port, which keeps
+// scenes resident between requests.
+//
+// Clients upload scenes, which are built once and cached by content hash
+// (see scene_cache), and then submit render jobs against them, as described
+// in render_protocol.hpp. Each job is split into tiles, which are rendered
+// on a shared thread pool at the job's priority and sent back, encoded, as
+// they finish; tiles from different jobs and clients are interleaved. Only
+// as many of a job's tiles are queued at once as the pool has threads, each
+// queueing the next as it finishes, so a job's size doesn't cost memory. A
+// client may have up to max_jobs_per_connection jobs in flight. If it
+// disconnects, its remaining tiles are dropped without being rendered.
+class render_daemon {
+public:
+    static constexpr int max_jobs_per_connection = 64;
+
+    explicit render_daemon(int threads = int(std::thread::hardware_concurrency()),
+                           std::size_t max_scenes = 16)
+            : scenes_{max_scenes},
+              pool_{threads}
+    {}
+
+    render_daemon(const render_daemon&) = delete;
+    render_daemon& operator=(const render_daemon&) = delete;
+
+    // Listens at address (see listen_at()) and serves clients until stop()
+    // is called. Returns false if the socket couldn't be set up.
+    bool serve(const char* address)
+    {
+        const int fd = listen_at(address);
+        if (fd < 0) {
+            return false;
+        }
+
+        listen_fd_ = fd;
+        while (!stopping_) {
+            const int client_fd = ::accept(fd, nullptr, nullptr);
+            if (client_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            detail::set_no_delay(client_fd);
+            auto conn = std::make_shared<connection>(client_fd);
+            std::lock_guard<std::mutex> lock{clients_mutex_};
+            clients_.remove_if([](client& c) {
+                if (!c.conn->reader_done) {
+                    return false;
+                }
+                c.reader.join();
+                return true;
+            });
+            clients_.push_back({std::thread{[this, conn] { handle(conn); }}, conn});
+        }
+
+        // Any of their tiles still queued will find the connection closed
+        std::list<client> clients;
+        {
+            std::lock_guard<std::mutex> lock{clients_mutex_};
+            clients.swap(clients_);
+        }
+        for (auto& c : clients) {
+            c.conn->close();
+            c.reader.join();
+        }
+        listen_fd_ = -1;
+        ::close(fd);
+        if (detail::is_unix_address(address)) {
+            ::unlink(address);
+        }
+        return true;
+    }
+
+    // Makes serve() close every connection and return. May be called from
+    // any thread.
+    void stop()
+    {
+        stopping_ = true;
+        const int fd = listen_fd_;
+        if (fd >= 0) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    scene_cache& get_scene_cache() { return scenes_; }
+
+private:
+    struct connection {
+        explicit connection(int fd) : fd{fd} {}
+
+        ~connection() { ::close(fd); }
+
+        // Sends a message, unless the connection has been closed
+        bool send(message_type type, const std::vector<std::uint8_t>& payload)
+        {
+            std::lock_guard<std::mutex> lock{write_mutex};
+            if (!open) {
+                return false;
+            }
+            if (!send_message(fd, type, payload)) {
+                open = false;
+                return false;
+            }
+            return true;
+        }
+
+        void send_error(std::uint32_t job_id, const char* message)
+        {
+            detail::byte_buffer buf;
+            buf.put_u32(job_id);
+            buf.put_str(message);
+            send(message_type::error, buf.bytes);
+        }
+
+        // Stops any further messages being sent, and wakes the reader
+        void close()
+        {
+            open = false;
+            ::shutdown(fd, SHUT_RDWR);
+        }
+
+        const int fd;
+        std::mutex write_mutex;
+        std::atomic<bool> open{true};
+        std::atomic<bool> reader_done{false};
+        // The number of this client's jobs which haven't finished
+        std::atomic<int> jobs{0};
+    };
+
+    struct client {
+        std::thread reader;
+        std::shared_ptr<connection> conn;
+    };
+
+    struct job {
+        job(std::shared_ptr<connection> conn, std::shared_ptr<const dynamic_scene> scene,
+            const render_request& req, int tiles_x, int tile_count)
+                : conn{std::move(conn)},
+                  scene{std::move(scene)},
+                  req{req},
+                  tiles_x{tiles_x},
+                  tile_count{tile_count},
+                  remaining{tile_count}
+        {}
+
+        // The i'th tile of the region, in row-major order
+        tile get_tile(int i) const
+        {
+            const tile region = req.get_region();
+            const int ts = req.tile_size;
+            const int x = region.x + i % tiles_x * ts;
+            const int y = region.y + i / tiles_x * ts;
+            return {x, y, std::min(ts, region.x + region.width - x), std::min(ts, region.y + region.height - y)};
+        }
+
+        std::shared_ptr<connection> conn;
+        std::shared_ptr<const dynamic_scene> scene;
+        render_request req;
+        int tiles_x;
+        int tile_count;
+        // The index of the next tile to be rendered
+        std::atomic<int> next_tile{0};
+        std::atomic<int> remaining;
+    };
+
+    // Reads and acts on a client's messages until it disconnects
+    void handle(const std::shared_ptr<connection>& conn)
+    {
+        message_type type;
+        std::vector<std::uint8_t> payload;
+        while (conn->open && recv_message(conn->fd, type, payload)) {
+            if (type == message_type::upload_scene) {
+                if (const auto id = scenes_.insert(payload)) {
+                    detail::byte_buffer buf;
+                    buf.put_u64(*id);
+                    conn->send(message_type::scene_id, buf.bytes);
+                } else {
+                    conn->send_error(0, "malformed scene, or its id is taken by another");
+                }
+            } else if (type == message_type::render) {
+                const auto req = decode_request(payload);
+                if (!req) {
+                    conn->send_error(0, "malformed render request");
+                } else if (conn->jobs >= max_jobs_per_connection) {
+                    conn->send_error(req->job_id, "too many jobs in flight");
+                } else if (auto scene = scenes_.find(req->scene_id)) {
+                    start_job(conn, std::move(scene), *req);
+                } else {
+                    conn->send_error(req->job_id, "unknown scene");
+                }
+            } else {
+                conn->send_error(0, "unexpected message");
+                break;
+            }
+        }
+        conn->close();
+        conn->reader_done = true;
+    }
+
+    void start_job(const std::shared_ptr<connection>& conn, std::shared_ptr<const dynamic_scene> scene,
+                   const render_request& req)
+    {
+        const tile region = req.get_region();
+        const int ts = req.tile_size;
+        const int tiles_x = (region.width + ts - 1) / ts;
+        const int tiles_y = (region.height + ts - 1) / ts;
+        auto job_ = std::make_shared<job>(conn, std::move(scene), req, tiles_x, tiles_x * tiles_y);
+        conn->jobs++;
+        if (job_->tile_count == 0) {
+            send_job_done(*job_);
+            return;
+        }
+        for (int i = 0; i < std::min(job_->tile_count, pool_.get_thread_count()); i++) {
+            submit_next_tile(job_);
+        }
+    }
+
+    // Queues a task which renders the job's next tile, and then queues
+    // another to carry on with the tile after
+    void submit_next_tile(std::shared_ptr<job> job_)
+    {
+        const int priority = job_->req.priority;
+        pool_.submit(priority, [this, job_ = std::move(job_)] {
+            const int i = job_->next_tile++;
+            if (i < job_->tile_count) {
+                render_job_tile(*job_, job_->get_tile(i));
+                if (job_->next_tile < job_->tile_count) {
+                    submit_next_tile(job_);
+                }
+            }
+        });
+    }
+
+    static void send_job_done(job& job_)
+    {
+        // Counted off first, so that the client may submit another job as
+        // soon as it hears this one is done
+        job_.conn->jobs--;
+        detail::byte_buffer buf;
+        buf.put_u32(job_.req.job_id);
+        buf.put_u32(std::uint32_t(job_.tile_count));
+        job_.conn->send(message_type::job_done, buf.bytes);
+    }
+
+    static void render_job_tile(job& job_, const tile& tile_)
+    {
+        const render_request& req = job_.req;
+        if (job_.conn->open) {
+            tile_message msg{req.job_id, tile_, req.encoding, {}};
+            const detail::camera_view<dynamic_scene> view{*job_.scene, req.cam};
+            const ray_tracer tracer{req.max_depth};
+            if (req.encoding == tile_encoding::rgb32f) {
+                hdr_canvas canvas{tile_.width, tile_.height};
+                offset_canvas<hdr_canvas> target{canvas, -tile_.x, -tile_.y};
+                tracer.render_tile(view, target, req.width, req.height, tile_, req.step);
+                detail::byte_buffer buf;
+                buf.bytes.reserve(canvas.get_pixels().size() * 12);
+                for (const auto& col : canvas.get_pixels()) {
+                    buf.put_f32(col.r);
+                    buf.put_f32(col.g);
+                    buf.put_f32(col.b);
+                }
+                msg.data = std::move(buf.bytes);
+            } else {
+                dynamic_canvas canvas{tile_.width, tile_.height};
+                offset_canvas<dynamic_canvas> target{canvas, -tile_.x, -tile_.y};
+                tracer.render_tile(view, target, req.width, req.height, tile_, req.step);
+                const auto* pixels = reinterpret_cast<const std::uint8_t*>(canvas.get_pixels().data());
+                if (req.encoding == tile_encoding::png) {
+                    stbi_write_png_to_func(detail::append_to_vector, &msg.data, tile_.width, tile_.height, 4,
+                                           pixels, tile_.width * canvas.bpp);
+                } else {
+                    msg.data.assign(pixels, pixels + canvas.get_pixels().size() * canvas.bpp);
+                }
+            }
+            job_.conn->send(message_type::tile, encode_tile(msg));
+        }
+
+        // The last tile to finish reports the job done, after every other
+        // tile has been sent
+        if (--job_.remaining == 0) {
+            send_job_done(job_);
+        }
+    }
+
+    scene_cache scenes_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> listen_fd_{-1};
+    std::mutex clients_mutex_;
+    std::list<client> clients_;
+    // Declared last, so that queued tiles are finished (or dropped) before
+    // anything they use is destroyed
+    priority_thread_pool pool_;
+};
+
+// A connection to a render_daemon
+class render_client {
+public:
+    render_client() = default;
+
+    render_client(const render_client&) = delete;
+    render_client& operator=(const render_client&) = delete;
+
+    ~render_client()
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // Connects to a daemon at address (see connect_to())
+    bool connect(const char* address)
+    {
+        fd_ = connect_to(address);
+        if (fd_ < 0) {
+            return fail("couldn't connect");
+        }
+        return true;
+    }
+
+    // Makes any send or receive which takes longer than timeout fail, so
+    // that a stalled daemon can be given up on
+    void set_timeout(std::chrono::milliseconds timeout)
+    {
+        timeval tv{};
+        tv.tv_sec = long(timeout.count() / 1000);
+        tv.tv_usec = long(timeout.count() % 1000 * 1000);
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    // Uploads an encoded scene (see encode_scene()), returning the id to
+    // render it with. Uploading a scene the daemon already has is cheap.
+    std::optional<std::uint64_t> upload_scene(const std::vector<std::uint8_t>& bytes)
+    {
+        errno = 0;
+        if (!send_message(fd_, message_type::upload_scene, bytes)) {
+            lost();
+            return std::nullopt;
+        }
+        message_type type;
+        std::vector<std::uint8_t> payload;
+        while (recv_message(fd_, type, payload)) {
+            detail::byte_reader in{payload};
+            if (type == message_type::scene_id) {
+                return in.get_u64();
+            } else if (type == message_type::error) {
+                in.get_u32();
+                fail(in.get_str());
+                return std::nullopt;
+            }
+        }
+        lost();
+        return std::nullopt;
+    }
+
+    // Submits a job without waiting for it, so that several can be in
+    // flight at once; see wait_for_job()
+    bool submit(const render_request& req)
+    {
+        errno = 0;
+        return send_message(fd_, message_type::render, encode_request(req)) || lost();
+    }
+
+    // Waits for the next of the submitted jobs to finish, calling
+    // on_tile(tile_message) for each tile (of any job) which arrives in the
+    // meantime, and returns its job id. Returns nullopt if the daemon
+    // reported an error, sent a malformed tile or the connection failed;
+    // see get_error().
+    template <typename TileFunc>
+    std::optional<std::uint32_t> wait_for_job(TileFunc&& on_tile)
+    {
+        errno = 0;
+        message_type type;
+        std::vector<std::uint8_t> payload;
+        while (recv_message(fd_, type, payload)) {
+            detail::byte_reader in{payload};
+            if (type == message_type::tile) {
+                const auto msg = decode_tile(payload);
+                if (!msg) {
+                    fail("malformed tile");
+                    return std::nullopt;
+                }
+                on_tile(*msg);
+            } else if (type == message_type::job_done) {
+                return in.get_u32();
+            } else if (type == message_type::error) {
+                in.get_u32();
+                fail(in.get_str());
+                return std::nullopt;
+            }
+        }
+        lost();
+        return std::nullopt;
+    }
+
+    // Submits a job and waits for it to finish, calling on_tile(tile_message)
+    // for each of its tiles as they arrive. Returns false if the daemon
+    // reported an error, sent a malformed tile or the connection failed;
+    // see get_error().
+    template <typename TileFunc>
+    bool render(const render_request& req, TileFunc&& on_tile)
+    {
+        if (!submit(req)) {
+            return false;
+        }
+        while (true) {
+            const auto done = wait_for_job([&](const tile_message& msg) {
+                if (msg.job_id == req.job_id) {
+                    on_tile(msg);
+                }
+            });
+            if (!done) {
+                return false;
+            }
+            if (*done == req.job_id) {
+                return true;
+            }
+        }
+    }
+
+    const std::string& get_error() const { return error_; }
+
+private:
+    bool fail(std::string message)
+    {
+        error_ = std::move(message);
+        return false;
+    }
+
+    // Records why a receive failed: either the timeout passed, or the
+    // connection was closed or broken
+    bool lost()
+    {
+        return fail(errno == EAGAIN || errno == EWOULDBLOCK ? "timed out" : "connection lost");
+    }
+
+    int fd_ = -1;
+    std::string error_;
+};
+
+} // end namespace rt
@@ -0,0 +1,557 @@
+
+/*
+ * Binary encoding of scenes, render jobs and tiles, for rendering over a socket
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "byte_buffer.hpp"
+#include "dynamic_scene.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace rt {
+
+// Every message is a one-byte type and a 32-bit payload length, followed by
+// the payload. All values are little-endian.
+//
+//   upload_scene  client -> server   an encoded scene (see encode_scene())
+//   scene_id      server -> client   u64 content hash of the uploaded scene
+//   render        client -> server   a render_request
+//   tile          server -> client   a tile_message, one per tile of a job
+//   job_done      server -> client   u32 job id, u32 number of tiles sent
+//   error         server -> client   u32 job id (or 0), then a message string
+enum class message_type : std::uint8_t {
+    upload_scene = 1,
+    scene_id = 2,
+    render = 3,
+    tile = 4,
+    job_done = 5,
+    error = 6
+};
+
+enum class tile_encoding : std::uint8_t {
+    // 8-bit RGBA pixels, row by row
+    rgba8 = 0,
+    // A PNG file of the tile
+    png = 1,
+    // Linear, unclamped float RGB, for clients which quantise the image
+    // themselves
+    rgb32f = 2
+};
+
+struct render_request {
+    // Chosen by the client, to match up the replies when several of its jobs
+    // are in flight at once
+    std::uint32_t job_id = 0;
+    std::uint64_t scene_id = 0;
+    camera cam{vec3{3.0, 2.0, 4.0}, vec3{-1.0, 0.5, 0.0}};
+    int width = 512;
+    int height = 512;
+    // The part of the image to render, or the whole image if this is empty.
+    // It is split into tiles starting from its top-left corner.
+    tile region{0, 0, 0, 0};
+    // The quality settings: the maximum ray depth, and the pixel step (as
+    // for ray_tracer::render_tile())
+    int max_depth = 5;
+    int step = 1;
+    int tile_size = 32;
+    // Tiles of higher priority jobs are rendered before any waiting tiles of
+    // lower priority ones
+    int priority = 0;
+    tile_encoding encoding = tile_encoding::rgba8;
+
+    tile get_region() const
+    {
+        return region.width > 0 && region.height > 0 ? region : tile{0, 0, width, height};
+    }
+};
+
+struct tile_message {
+    std::uint32_t job_id = 0;
+    tile tile_{};
+    tile_encoding encoding = tile_encoding::rgba8;
+    std::vector<std::uint8_t> data;
+};
+
+namespace detail {
+
+// Surfaces are pairs of function pointers, so they are sent by their index
+// in this table
+inline const surface* const known_surfaces[] = {&surfaces::shiny, &surfaces::checkerboard};
+
+inline int find_surface(const surface& s)
+{
+    for (std::size_t i = 0; i < std::size(known_surfaces); i++) {
+        const surface& k = *known_surfaces[i];
+        if (k.diffuse == s.diffuse && k.specular == s.specular && k.reflect == s.reflect &&
+            k.roughness == s.roughness) {
+            return int(i);
+        }
+    }
+    return -1;
+}
+
+inline void put_vec3(byte_buffer& buf, const vec3& v)
+{
+    buf.put_f64(v.x);
+    buf.put_f64(v.y);
+    buf.put_f64(v.z);
+}
+
+inline vec3 get_vec3(byte_reader& in)
+{
+    const real_t x = real_t(in.get_f64());
+    const real_t y = real_t(in.get_f64());
+    return {x, y, real_t(in.get_f64())};
+}
+
+inline bool write_all(int fd, const std::uint8_t* data, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= std::size_t(n);
+    }
+    return true;
+}
+
+inline bool read_all(int fd, std::uint8_t* data, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = ::recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= std::size_t(n);
+    }
+    return true;
+}
+
+
+// Messages are small and latency matters, so don't let TCP hold them back.
+// This fails harmlessly on Unix domain sockets.
+inline void set_no_delay(int fd)
+{
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+inline bool is_unix_address(const char* address)
+{
+    return std::strchr(address, '/') != nullptr;
+}
+
+// Calls func(const sockaddr*, socklen_t, int family) with each address an
+// address string resolves to, until it returns a socket, and returns that
+// socket or -1
+template <typename Func>
+int with_resolved_address(const char* address, bool passive, Func&& func)
+{
+    if (is_unix_address(address)) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (std::strlen(address) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        std::strcpy(addr.sun_path, address);
+        return func(reinterpret_cast<const sockaddr*>(&addr), socklen_t(sizeof(addr)), AF_UNIX);
+    }
+
+    const char* colon = std::strrchr(address, ':');
+    if (!colon) {
+        return -1;
+    }
+    const std::string host(address, colon);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* results = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), colon + 1, &hints, &results) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (const addrinfo* ai = results; ai && fd < 0; ai = ai->ai_next) {
+        fd = func(ai->ai_addr, ai->ai_addrlen, ai->ai_family);
+    }
+    ::freeaddrinfo(results);
+    return fd;
+}
+
+} // end namespace detail
+
+// Sockets are named by address strings: anything containing a '/' is the
+// path of a Unix domain socket, and anything else is "host:port" for TCP
+// (with an empty host meaning every interface, when listening).
+
+// Returns a socket listening at address, or -1 (with errno set) on failure.
+// A Unix domain socket left behind at the same path is replaced, but
+// anything else there is left alone, and fails with EADDRINUSE.
+inline int listen_at(const char* address)
+{
+    if (detail::is_unix_address(address)) {
+        struct stat st;
+        if (::lstat(address, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                errno = EADDRINUSE;
+                return -1;
+            }
+            ::unlink(address);
+        }
+    }
+    return detail::with_resolved_address(address, true, [](const sockaddr* addr, socklen_t len, int family) {
+        const int fd = ::socket(family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        const int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, addr, len) != 0 || ::listen(fd, 16) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    });
+}
+
+// Returns a socket connected to address, or -1 on failure
+inline int connect_to(const char* address)
+{
+    return detail::with_resolved_address(address, false, [](const sockaddr* addr, socklen_t len, int family) {
+        const int fd = ::socket(family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (::connect(fd, addr, len) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        detail::set_no_delay(fd);
+        return fd;
+    });
+}
+
+// The largest message payload which will be accepted, for the scenes and
+// tiles; other messages have much smaller limits (see get_max_payload_size())
+constexpr std::size_t max_message_size = 256 * 1024 * 1024;
+
+// The largest width or height of image which may be requested
+constexpr int max_image_size = 16384;
+
+// The most tiles a single render request may be split into, so that a tiny
+// tile size can't be asked for with a huge image
+constexpr int max_tiles_per_job = 1 << 20;
+
+// Encodes the things and lights of a scene (but not its camera, which is
+// given with each render request, so that moving the camera doesn't change
+// the scene). Values are stored as doubles whatever real_t is. Returns
+// nullopt if a thing uses a surface other than those in rt::surfaces.
+template <typename Scene>
+std::optional<std::vector<std::uint8_t>> encode_scene(const Scene& scene)
+{
+    detail::byte_buffer buf;
+    buf.put_u32(std::uint32_t(scene.get_things().size()));
+    for (const any_thing& thing : scene.get_things()) {
+        const int surface_index = detail::find_surface(thing.get_surface());
+        if (surface_index < 0) {
+            return std::nullopt;
+        }
+        thing.visit([&](const auto& t) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(t)>, sphere>) {
+                buf.put_u8(0);
+                buf.put_u8(std::uint8_t(surface_index));
+                detail::put_vec3(buf, t.centre);
+                buf.put_f64(t.radius2);
+            } else {
+                buf.put_u8(1);
+                buf.put_u8(std::uint8_t(surface_index));
+                detail::put_vec3(buf, t.norm);
+                buf.put_f64(t.offset);
+            }
+        });
+    }
+    buf.put_u32(std::uint32_t(scene.get_lights().size()));
+    for (const light& l : scene.get_lights()) {
+        detail::put_vec3(buf, l.pos);
+        buf.put_f64(l.col.r);
+        buf.put_f64(l.col.g);
+        buf.put_f64(l.col.b);
+        buf.put_f64(l.range);
+    }
+    return std::move(buf.bytes);
+}
+
+// Decodes a scene written by encode_scene(), returning nullopt if it is
+// malformed. The scene's camera is the demo scene's, and is expected to be
+// replaced.
+inline std::optional<dynamic_scene> decode_scene(const std::vector<std::uint8_t>& bytes)
+{
+    detail::byte_reader in{bytes};
+
+    // Each thing takes at least 34 bytes, so a bad count can't make us
+    // reserve an enormous vector
+    const std::uint32_t thing_count = in.get_u32();
+    if (thing_count > in.get_remaining() / 34) {
+        return std::nullopt;
+    }
+    std::vector<any_thing> things;
+    things.reserve(thing_count);
+    for (std::uint32_t i = 0; i < thing_count && in.ok(); i++) {
+        const std::uint8_t kind = in.get_u8();
+        const std::uint8_t surface_index = in.get_u8();
+        if (kind > 1 || surface_index >= std::size(detail::known_surfaces)) {
+            return std::nullopt;
+        }
+        const surface& surface_ = *detail::known_surfaces[surface_index];
+        const vec3 v = detail::get_vec3(in);
+        const real_t k = real_t(in.get_f64());
+        if (kind == 0) {
+            sphere s{v, 0, surface_};
+            s.radius2 = k;
+            things.push_back(s);
+        } else {
+            things.push_back(plane{v, k, surface_});
+        }
+    }
+
+    const std::uint32_t light_count = in.get_u32();
+    if (light_count > in.get_remaining() / 56) {
+        return std::nullopt;
+    }
+    std::vector<light> lights;
+    lights.reserve(light_count);
+    for (std::uint32_t i = 0; i < light_count && in.ok(); i++) {
+        const vec3 pos = detail::get_vec3(in);
+        const vec3 col = detail::get_vec3(in);
+        lights.push_back(light{pos, color{col.x, col.y, col.z}, real_t(in.get_f64())});
+    }
+
+    if (!in.ok() || in.get_remaining() != 0) {
+        return std::nullopt;
+    }
+    return dynamic_scene{things, lights, camera{vec3{3.0, 2.0, 4.0}, vec3{-1.0, 0.5, 0.0}}};
+}
+
+// The 64-bit FNV-1a hash of an encoded scene, which identifies it
+inline std::uint64_t get_scene_hash(const std::vector<std::uint8_t>& bytes)
+{
+    return fnv1a_hash(bytes.data(), bytes.size());
+}
+
+inline std::vector<std::uint8_t> encode_request(const render_request& req)
+{
+    detail::byte_buffer buf;
+    buf.put_u32(req.job_id);
+    buf.put_u64(req.scene_id);
+    detail::put_vec3(buf, req.cam.pos);
+    detail::put_vec3(buf, req.cam.forward);
+    detail::put_vec3(buf, req.cam.right);
+    detail::put_vec3(buf, req.cam.up);
+    buf.put_u32(std::uint32_t(req.width));
+    buf.put_u32(std::uint32_t(req.height));
+    buf.put_u32(std::uint32_t(req.region.x));
+    buf.put_u32(std::uint32_t(req.region.y));
+    buf.put_u32(std::uint32_t(req.region.width));
+    buf.put_u32(std::uint32_t(req.region.height));
+    buf.put_u8(std::uint8_t(req.max_depth));
+    buf.put_u8(std::uint8_t(req.step));
+    buf.put_u16(std::uint16_t(req.tile_size));
+    buf.put_u32(std::uint32_t(req.priority));
+    buf.put_u8(std::uint8_t(req.encoding));
+    return std::move(buf.bytes);
+}
+
+// Decodes a render request, returning nullopt if it is malformed or asks for
+// an unreasonable image
+inline std::optional<render_request> decode_request(const std::vector<std::uint8_t>& bytes)
+{
+    detail::byte_reader in{bytes};
+    render_request req;
+    req.job_id = in.get_u32();
+    req.scene_id = in.get_u64();
+    // The camera's vectors are sent as they are, rather than as a position
+    // and target, so that the image matches a local render exactly
+    req.cam.pos = detail::get_vec3(in);
+    req.cam.forward = detail::get_vec3(in);
+    req.cam.right = detail::get_vec3(in);
+    req.cam.up = detail::get_vec3(in);
+    req.width = int(in.get_u32());
+    req.height = int(in.get_u32());
+    req.region.x = int(in.get_u32());
+    req.region.y = int(in.get_u32());
+    req.region.width = int(in.get_u32());
+    req.region.height = int(in.get_u32());
+    req.max_depth = in.get_u8();
+    req.step = in.get_u8();
+    req.tile_size = in.get_u16();
+    req.priority = int(in.get_u32());
+    const std::uint8_t encoding = in.get_u8();
+    req.encoding = tile_encoding(encoding);
+
+    if (!in.ok() || in.get_remaining() != 0 || encoding > 2 ||
+        req.width < 1 || req.width > max_image_size || req.height < 1 || req.height > max_image_size ||
+        req.tile_size < 1 || req.step < 1 || req.step > req.tile_size) {
+        return std::nullopt;
+    }
+    const tile r = req.get_region();
+    if (r.x < 0 || r.y < 0 || r.width < 0 || r.height < 0 ||
+        r.width > req.width - r.x || r.height > req.height - r.y) {
+        return std::nullopt;
+    }
+    const std::int64_t tiles_x = (r.width + req.tile_size - 1) / req.tile_size;
+    const std::int64_t tiles_y = (r.height + req.tile_size - 1) / req.tile_size;
+    if (tiles_x * tiles_y > max_tiles_per_job) {
+        return std::nullopt;
+    }
+    return req;
+}
+
+inline std::vector<std::uint8_t> encode_tile(const tile_message& msg)
+{
+    detail::byte_buffer buf;
+    buf.bytes.reserve(21 + msg.data.size());
+    buf.put_u32(msg.job_id);
+    buf.put_u32(std::uint32_t(msg.tile_.x));
+    buf.put_u32(std::uint32_t(msg.tile_.y));
+    buf.put_u32(std::uint32_t(msg.tile_.width));
+    buf.put_u32(std::uint32_t(msg.tile_.height));
+    buf.put_u8(std::uint8_t(msg.encoding));
+    buf.put_bytes(msg.data.data(), msg.data.size());
+    return std::move(buf.bytes);
+}
+
+// Decodes a tile, returning nullopt if it is malformed: if it doesn't lie
+// within the largest image which can be requested, or its pixels aren't the
+// size its encoding needs. The caller must still check that the tile lies
+// within the image it asked for.
+inline std::optional<tile_message> decode_tile(const std::vector<std::uint8_t>& bytes)
+{
+    detail::byte_reader in{bytes};
+    tile_message msg;
+    msg.job_id = in.get_u32();
+    const std::uint32_t x = in.get_u32();
+    const std::uint32_t y = in.get_u32();
+    const std::uint32_t width = in.get_u32();
+    const std::uint32_t height = in.get_u32();
+    const std::uint8_t encoding = in.get_u8();
+    constexpr auto max_size = std::uint32_t(max_image_size);
+    if (!in.ok() || encoding > 2 || width < 1 || width > max_size || height < 1 || height > max_size ||
+        x > max_size - width || y > max_size - height) {
+        return std::nullopt;
+    }
+    msg.tile_ = {int(x), int(y), int(width), int(height)};
+    msg.encoding = tile_encoding(encoding);
+    const std::size_t size = in.get_remaining();
+    const std::size_t pixels = std::size_t(width) * height;
+    if ((msg.encoding == tile_encoding::rgba8 && size != pixels * 4) ||
+        (msg.encoding == tile_encoding::rgb32f && size != pixels * 12)) {
+        return std::nullopt;
+    }
+    const std::uint8_t* data = in.get_bytes(size);
+    msg.data.assign(data, data + size);
+    return msg;
+}
+
+// Sends a message on a stream socket, returning false if the connection has
+// gone. Messages sent from several threads at once must be serialised by
+// the caller.
+inline bool send_message(int fd, message_type type, const std::vector<std::uint8_t>& payload)
+{
+    detail::byte_buffer header;
+    header.put_u8(std::uint8_t(type));
+    header.put_u32(std::uint32_t(payload.size()));
+    return detail::write_all(fd, header.bytes.data(), header.bytes.size()) &&
+           detail::write_all(fd, payload.data(), payload.size());
+}
+
+// The largest payload which will be accepted for a type of message. Only
+// scenes and tiles can be large; anything else which is much bigger than
+// it should be is taken to be an attempt to waste the receiver's memory.
+inline std::size_t get_max_payload_size(message_type type)
+{
+    switch (type) {
+    case message_type::upload_scene:
+    case message_type::tile:
+        return max_message_size;
+    case message_type::scene_id:
+    case message_type::job_done:
+        return 8;
+    case message_type::render:
+        return 256;
+    default:
+        return 64 * 1024;
+    }
+}
+
+// Waits for the next message, returning false if the connection is closed
+// or the message is too large for its type
+inline bool recv_message(int fd, message_type& type, std::vector<std::uint8_t>& payload)
+{
+    std::uint8_t header[5];
+    if (!detail::read_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    detail::byte_reader in{header, sizeof(header)};
+    type = message_type(in.get_u8());
+    const std::uint32_t size = in.get_u32();
+    if (size > get_max_payload_size(type)) {
+        return false;
+    }
+    // The buffer grows only as the payload arrives, so that a header which
+    // claims a large payload costs nothing until the payload is sent
+    constexpr std::size_t chunk_size = 64 * 1024;
+    payload.clear();
+    while (payload.size() < size) {
+        const std::size_t offset = payload.size();
+        payload.resize(offset + std::min<std::size_t>(size - offset, chunk_size));
+        if (!detail::read_all(fd, payload.data() + offset, payload.size() - offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // end namespace rt
@@ -1,7 +1,23 @@
 
 #include "raytracer.hpp"
+#include "async_render.hpp"
+#include "batch_render.hpp"
+#include "dynamic_scene.hpp"
+#include "distributed.hpp"
+#include "half.hpp"
+#include "hdr_image.hpp"
+#include "instancing.hpp"
+#include "render_control.hpp"
+#include "render_daemon.hpp"
+#include "sequence.hpp"
+#include "wavefront.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "stb_image_write.h"
@@ -10,66 +26,107 @@ using namespace rt;
 
 namespace {
 
-struct dynamic_scene {
-    dynamic_scene()
-            : cam_{vec3{ 3.0, 2.0, 4.0 }, vec3{ -1.0, 0.5, 0.0 }}
-    {
-        things_.push_back(plane{vec3{ 0.0, 1.0, 0.0 }, 0.0, surfaces::checkerboard});
-        things_.push_back(sphere{vec3{ 0.0, 1.0, -0.25 }, 1.0, surfaces::shiny});
-        things_.push_back(sphere{vec3{ -1.0, 0.5, 1.5 }, 0.5, surfaces::shiny});
-
-        lights_.push_back(light{ {-2.0, 2.5, 0.0}, {0.49, 0.07, 0.07}});
-        lights_.push_back(light{ {1.5, 2.5, 1.5}, {0.07, 0.07, 0.49} });
-        lights_.push_back(light{ {1.5, 2.5, -1.5}, {0.07, 0.49, 0.071} });
-        lights_.push_back(light{ {0.0, 3.5, 0.0}, {0.21, 0.21, 0.35} });
-    }
-
-    const auto& get_things() const { return things_; }
+// The demo scene's plane and lights, plus count copies of a small cluster
+// of spheres scattered over the plane, sharing a single BLAS
+instanced_scene make_instanced_scene(int count)
+{
+    const dynamic_scene base{};
+    instanced_scene scene{{base.get_things()[0]},
+                          {base.get_lights().begin(), base.get_lights().end()},
+                          base.get_camera()};
 
-    const auto& get_lights() const { return lights_; }
+    auto cluster = std::make_shared<const object_geometry>(std::vector<any_thing>{
+            sphere{{0.0, 0.5, 0.0}, 0.5, surfaces::shiny},
+            sphere{{0.7, 0.25, 0.0}, 0.25, surfaces::shiny},
+            sphere{{-0.7, 0.25, 0.0}, 0.25, surfaces::shiny},
+            sphere{{0.0, 0.25, 0.7}, 0.25, surfaces::shiny},
+            sphere{{0.0, 0.25, -0.7}, 0.25, surfaces::shiny},
+            sphere{{0.0, 1.2, 0.0}, 0.2, surfaces::shiny}
+    });
 
-    const auto& get_camera() const { return cam_; }
+    const int side = int(std::ceil(std::sqrt(real_t(count))));
+    for (int i = 0; i < count; i++) {
+        const real_t angle = real_t(i) * real_t{0.7};
+        transform xform = transform::rotate_y(std::sin(angle), std::cos(angle));
+        xform.scale = real_t{2.0} / side;
+        xform.translation = {real_t(-4.0 + 8.0 * (i % side + 0.5) / side), 0.0,
+                             real_t(-4.0 + 8.0 * (i / side + 0.5) / side)};
+        scene.add_instance(cluster, xform);
+    }
+    scene.build();
+    return scene;
+}
 
-private:
-    std::vector<any_thing> things_;
-    std::vector<light> lights_;
-    camera cam_;
-};
+// Builds each spatial index over the scene in turn, on build_threads
+// threads, and renders the scene through it on one, reporting the times
+// and a hash of each image so that they can be checked to match
+void bench_indexes(dynamic_scene& scene, int width, int height, int build_threads)
+{
+    constexpr std::pair<spatial_index, const char*> indexes[] = {
+            {spatial_index::bvh, "binary BVH"},
+            {spatial_index::grid, "grid"},
+            {spatial_index::compressed_bvh, "compressed BVH"},
+            {spatial_index::wide_bvh, "wide BVH"}};
 
-struct dynamic_canvas {
+    bvh_build_options opts{};
+    opts.thread_count = build_threads;
+    scene.set_bvh_build_options(opts);
+    std::fprintf(stderr, "%zu things, built on %d thread(s), rendered at %dx%d\n",
+                 scene.get_things().size(), build_threads, width, height);
 
-    int width;
-    int height;
-    static constexpr int bpp = 4;
+    for (const auto& [index, name] : indexes) {
+        scene.set_spatial_index(index);
+        const auto build_start = render_clock::now();
+        scene.build_index();
+        const std::chrono::duration<double, std::milli> build_time = render_clock::now() - build_start;
 
-    dynamic_canvas(int width, int height)
-            : width{width},
-              height{height},
-              pixels_(width * height)
-    {}
+        dynamic_canvas canvas{width, height};
+        const auto trace_start = render_clock::now();
+        ray_tracer{}.render(scene, canvas, width, height);
+        const std::chrono::duration<double, std::milli> trace_time = render_clock::now() - trace_start;
 
-    void set_pixel(int x, int y, color col)
-    {
-        pixels_[x + width * y] = rgba::from_color(col);
+        const auto* pixels = reinterpret_cast<const std::uint8_t*>(canvas.get_pixels().data());
+        std::fprintf(stderr, "%-15s build %8.1f ms  trace %8.1f ms  image %016llx\n", name,
+                     build_time.count(), trace_time.count(),
+                     static_cast<unsigned long long>(fnv1a_hash(pixels, canvas.get_pixels().size() * canvas.bpp)));
     }
+}
 
-    const auto& get_pixels() const { return pixels_; }
-
-private:
-    struct rgba {
-        static rgba from_color(const color& col) {
-            constexpr auto clamp = [] (real_t val) { return std::clamp<real_t>(val, 0.0, 1.0); };
-            return {uint8_t(std::floor(clamp(col.r) * 255.0)),
-                    uint8_t(std::floor(clamp(col.g) * 255.0)),
-                    uint8_t(std::floor(clamp(col.b) * 255.0)),
-                    255 };
+// Renders the scene runs times on one thread, after a warm-up render, and
+// reports the best and median times along with the memory taken by the
+// scene and by framebuffers at each precision, so that builds with
+// different real_t can be compared
+void bench_render(const dynamic_scene& scene, int width, int height, int runs)
+{
+    const auto index_size = [&]() -> std::size_t {
+        switch (scene.get_spatial_index()) {
+        case spatial_index::bvh: return scene.get_bvh().get_memory_size();
+        case spatial_index::grid: return scene.get_grid().get_memory_size();
+        case spatial_index::compressed_bvh: return scene.get_compressed_bvh().get_memory_size();
+        case spatial_index::wide_bvh: return scene.get_wide_bvh().get_memory_size();
         }
+        return 0;
+    }();
+    const double pixels = double(width) * height;
+    std::fprintf(stderr, "real_t is %zu bytes; %zu things, rendered at %dx%d\n", sizeof(real_t),
+                 scene.get_things().size(), width, height);
+    std::fprintf(stderr, "things %8.0f KiB  index %8.0f KiB\n",
+                 scene.get_things().size() * sizeof(any_thing) / 1024.0, index_size / 1024.0);
+    std::fprintf(stderr, "framebuffer: real_t %8.0f KiB  half %8.0f KiB  RGBA8 %8.0f KiB\n",
+                 pixels * sizeof(color) / 1024, pixels * sizeof(basic_color<half>) / 1024, pixels * 4 / 1024);
 
-        uint8_t r, g, b, a;
-    };
-
-    std::vector<rgba> pixels_;
-};
+    dynamic_canvas canvas{width, height};
+    ray_tracer{}.render(scene, canvas, width, height);
+    std::vector<double> times;
+    for (int i = 0; i < runs; i++) {
+        const auto start = render_clock::now();
+        ray_tracer{}.render(scene, canvas, width, height);
+        times.push_back(std::chrono::duration<double, std::milli>(render_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    std::fprintf(stderr, "render: best %8.1f ms  median %8.1f ms  over %d runs\n", times.front(),
+                 times[times.size() / 2], runs);
+}
 
 }
 
@@ -77,18 +134,389 @@ int main(int argc, char** argv)
 {
     int width = 512;
     int height = 512;
+    int deadline_ms = 0;
+    std::optional<tile> crop;
+    int frames = 0;
+    bool raw_video = false;
+    int spheres = 0;
+    int instances = 0;
+    bool wavefront = false;
+    int lights = 0;
+    light_sampling sampling{};
+    bool use_shadow_cache = false;
+    bool half_framebuffer = false;
+    const char* hdr_path = nullptr;
+    const char* exr_path = nullptr;
+    quantise_options quantise{};
+    const char* serve_address = nullptr;
+    const char* connect_address = nullptr;
+    std::vector<std::string> workers;
+    int threads = 0;
+    bool print_hash = false;
+    int batch = 0;
+    spatial_index index = spatial_index::wide_bvh;
+    int morton_levels = -1;
+    bool volume = false;
+    bool bench_index = false;
+    int bench_runs = 0;
 
-    if (argc > 2) {
-        width = atoi(argv[1]);
-        height = atoi(argv[2]);
+    // Usage: raytracer-rt [width height] [--deadline-ms N] [--crop X Y W H]
+    //                     [--frames N [--raw-video]] [--spheres N] [--instances N]
+    //                     [--wavefront] [--lights N] [--light-cutoff X] [--max-lights N]
+    //                     [--shadow-cache] [--half] [--hdr FILE] [--exr FILE] [--exposure X]
+    //                     [--srgb] [--dither] [--serve ADDRESS] [--connect ADDRESS]
+    //                     [--workers ADDRESS,ADDRESS,...] [--threads N] [--hash] [--batch N]
+    //                     [--grid] [--morton-levels N] [--compressed-bvh] [--binary-bvh]
+    //                     [--volume] [--bench-index] [--bench N]
+    int n_positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_runs = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--bench-index") == 0) {
+            bench_index = true;
+        } else if (std::strcmp(argv[i], "--volume") == 0) {
+            volume = true;
+        } else if (std::strcmp(argv[i], "--binary-bvh") == 0) {
+            index = spatial_index::bvh;
+        } else if (std::strcmp(argv[i], "--compressed-bvh") == 0) {
+            index = spatial_index::compressed_bvh;
+        } else if (std::strcmp(argv[i], "--morton-levels") == 0 && i + 1 < argc) {
+            morton_levels = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--grid") == 0) {
+            index = spatial_index::grid;
+        } else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--hash") == 0) {
+            print_hash = true;
+        } else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_address = argv[++i];
+        } else if (std::strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            connect_address = argv[++i];
+        } else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            const std::string list = argv[++i];
+            for (std::size_t start = 0, end = 0; end != std::string::npos; start = end + 1) {
+                end = list.find(',', start);
+                workers.push_back(list.substr(start, end - start));
+            }
+        } else if (std::strcmp(argv[i], "--hdr") == 0 && i + 1 < argc) {
+            hdr_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--exr") == 0 && i + 1 < argc) {
+            exr_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+            quantise.exposure = float(atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--srgb") == 0) {
+            quantise.srgb = true;
+        } else if (std::strcmp(argv[i], "--dither") == 0) {
+            quantise.dither = true;
+        } else if (std::strcmp(argv[i], "--half") == 0) {
+            half_framebuffer = true;
+        } else if (std::strcmp(argv[i], "--shadow-cache") == 0) {
+            use_shadow_cache = true;
+        } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            lights = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < argc) {
+            sampling.cutoff = real_t(atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--max-lights") == 0 && i + 1 < argc) {
+            sampling.max_lights = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--wavefront") == 0) {
+            wavefront = true;
+        } else if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--spheres") == 0 && i + 1 < argc) {
+            spheres = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--raw-video") == 0) {
+            raw_video = true;
+        } else if (std::strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc) {
+            deadline_ms = atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--crop") == 0 && i + 4 < argc) {
+            crop = tile{atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4])};
+            i += 4;
+        } else if (n_positional == 0) {
+            width = atoi(argv[i]);
+            n_positional++;
+        } else if (n_positional == 1) {
+            height = atoi(argv[i]);
+            n_positional++;
+        }
+    }
+
+    if (crop) {
+        // Clip the crop to the frame, so that the PNG holds only pixels
+        // that were rendered
+        const int x0 = std::max(crop->x, 0);
+        const int y0 = std::max(crop->y, 0);
+        const int x1 = std::min(crop->x + crop->width, width);
+        const int y1 = std::min(crop->y + crop->height, height);
+        if (crop->width <= 0 || crop->height <= 0 || x1 <= x0 || y1 <= y0) {
+            std::fprintf(stderr, "The crop must be a non-empty rectangle overlapping the %dx%d frame\n",
+                         width, height);
+            return 1;
+        }
+        crop = tile{x0, y0, x1 - x0, y1 - y0};
+    }
+
+    if (serve_address) {
+        render_daemon daemon{};
+        if (!daemon.serve(serve_address)) {
+            std::fprintf(stderr, "Couldn't listen on %s: %s\n", serve_address, std::strerror(errno));
+            return 1;
+        }
+        return 0;
     }
 
+    dynamic_scene scene = spheres > 0 && volume ? dynamic_scene::with_sphere_volume(spheres, index)
+                        : spheres > 0 ? dynamic_scene::with_sphere_field(spheres, index)
+                        : lights > 0 ? dynamic_scene::with_light_field(lights)
+                                     : dynamic_scene{};
+    scene.set_light_sampling(sampling);
+    scene.set_spatial_index(index);
+    if (morton_levels >= 0) {
+        // Build a binary BVH over the things with the given number of Morton
+        // levels, and report what that costs and the quality of the result.
+        // It is built separately, since the scene's own may not be (e.g.
+        // with --grid), and the wide BVHs are collapsed from it afterwards.
+        bvh_build_options opts{};
+        opts.morton_levels = morton_levels;
+        bvh tree{};
+        tree.set_build_options(opts);
+        const auto start = render_clock::now();
+        tree.build(scene.get_things());
+        const std::chrono::duration<double> elapsed = render_clock::now() - start;
+        std::fprintf(stderr, "BVH of %zu things built in %.1f ms (%.2f M things/s), SAH cost %.1f\n",
+                     scene.get_things().size(), elapsed.count() * 1000,
+                     scene.get_things().size() / elapsed.count() / 1e6, double(tree.sah_cost()));
+        scene.set_bvh_build_options(opts);
+    }
+    if (bench_index) {
+        bench_indexes(scene, width, height, threads > 0 ? threads : 1);
+        return 0;
+    }
+    if (bench_runs > 0) {
+        bench_render(scene, width, height, bench_runs);
+        return 0;
+    }
+    if (index == spatial_index::compressed_bvh) {
+        const double things = double(scene.get_things().size());
+        std::fprintf(stderr, "Compressed BVH takes %.1f bytes per thing, against %.1f for the binary BVH\n",
+                     scene.get_compressed_bvh().get_memory_size() / things, scene.get_bvh().get_memory_size() / things);
+    }
+
+    if (connect_address) {
+        // Have a daemon started with --serve render the image instead
+        render_client client;
+        if (!client.connect(connect_address)) {
+            std::fprintf(stderr, "Couldn't connect to %s\n", connect_address);
+            return 1;
+        }
+        const auto scene_id = client.upload_scene(*encode_scene(scene));
+        if (!scene_id) {
+            std::fprintf(stderr, "Couldn't upload scene: %s\n", client.get_error().c_str());
+            return 1;
+        }
+        render_request req{};
+        req.scene_id = *scene_id;
+        req.cam = scene.get_camera();
+        req.width = width;
+        req.height = height;
+        std::vector<std::uint8_t> pixels(std::size_t(width) * height * 4);
+        int bad_tiles = 0;
+        const bool ok = client.render(req, [&](const tile_message& msg) {
+            // decode_tile() has checked that the data fits the tile, but not
+            // that the tile fits this image
+            if (msg.encoding != tile_encoding::rgba8 || msg.tile_.width > width - msg.tile_.x ||
+                msg.tile_.height > height - msg.tile_.y) {
+                bad_tiles++;
+                return;
+            }
+            const std::size_t row_bytes = std::size_t(msg.tile_.width) * 4;
+            for (int y = 0; y < msg.tile_.height; y++) {
+                std::memcpy(&pixels[(std::size_t(width) * (msg.tile_.y + y) + msg.tile_.x) * 4],
+                            &msg.data[row_bytes * y], row_bytes);
+            }
+        });
+        if (!ok) {
+            std::fprintf(stderr, "Render failed: %s\n", client.get_error().c_str());
+            return 1;
+        }
+        if (bad_tiles > 0) {
+            std::fprintf(stderr, "Render failed: %d tiles didn't fit the image\n", bad_tiles);
+            return 1;
+        }
+        stbi_write_png("render-rt.png", width, height, 4, pixels.data(), width * 4);
+        return 0;
+    }
+
+    if (batch > 0) {
+        // Render thumbnails of the scene from cameras circling it, as a
+        // throughput test; the PNGs are encoded but not written out
+        std::vector<batch_job<dynamic_scene>> jobs;
+        for (int i = 0; i < batch; i++) {
+            const real_t angle = real_t{0.9273} + real_t{6.2832} * i / batch;
+            jobs.push_back({&scene, camera{vec3{5 * std::cos(angle), 2.0, 5 * std::sin(angle)}, vec3{-1.0, 0.5, 0.0}},
+                            width, height});
+        }
+        priority_thread_pool pool{threads > 0 ? threads : int(std::thread::hardware_concurrency())};
+        batch_options opts{};
+        opts.quantise = quantise;
+        opts.png = true;
+        std::atomic<std::size_t> png_bytes{0};
+        const auto stats = render_batch(pool, jobs, [&](const batch_image& image) { png_bytes += image.png.size(); },
+                                        opts);
+        std::fprintf(stderr, "%zu images (%zu bytes of PNG) in %.2f s, %.0f jobs/s\n", stats.jobs,
+                     png_bytes.load(), stats.elapsed.count(), stats.get_jobs_per_second());
+        return 0;
+    }
+
+    if (frames > 0) {
+        // A short fly-past of the scene, while the small sphere hops
+        const animation anim{
+            {{0.0, {3.0, 2.0, 4.0}, {-1.0, 0.5, 0.0}},
+             {1.0, {0.0, 2.5, 5.0}, {-1.0, 0.5, 0.0}},
+             {2.0, {-3.0, 2.0, 4.0}, {-1.0, 0.5, 0.0}}},
+            {{2, {{0.0, {0.0, 0.0, 0.0}},
+                  {0.5, {0.0, 1.0, 0.0}},
+                  {1.0, {0.0, 0.0, 0.0}},
+                  {1.5, {0.0, 1.0, 0.0}},
+                  {2.0, {0.0, 0.0, 0.0}}}}}
+        };
+        const auto frame_rate = frames / real_t{2.0};
+        if (raw_video) {
+            render_sequence<dynamic_canvas>(ray_tracer{}, scene, anim, width, height, frames,
+                                            frame_rate, raw_video_writer{stdout});
+        } else {
+            render_sequence<dynamic_canvas>(ray_tracer{}, scene, anim, width, height, frames,
+                                            frame_rate, png_sequence_writer{"render-rt"});
+        }
+        return 0;
+    }
+
+    if (hdr_path || exr_path) {
+        // Render into a linear framebuffer, streaming each tile to the HDR
+        // outputs as it finishes, then tonemap it for the PNG
+        constexpr int tile_size = 32;
+        hdr_canvas canvas{width, height};
+        using file_ptr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+        file_ptr hdr_file{hdr_path ? std::fopen(hdr_path, "wb") : nullptr, &std::fclose};
+        file_ptr exr_file{exr_path ? std::fopen(exr_path, "wb") : nullptr, &std::fclose};
+        if ((hdr_path && !hdr_file) || (exr_path && !exr_file)) {
+            std::fprintf(stderr, "Couldn't open %s for writing\n", hdr_file ? exr_path : hdr_path);
+            // Don't leave behind an empty file for the output which did open
+            if (hdr_file) {
+                hdr_file.reset();
+                std::remove(hdr_path);
+            }
+            if (exr_file) {
+                exr_file.reset();
+                std::remove(exr_path);
+            }
+            return 1;
+        }
+        std::optional<rgbe_writer> rgbe;
+        std::optional<exr_writer> exr;
+        if (hdr_file) {
+            rgbe.emplace(hdr_file.get(), width, height);
+        }
+        if (exr_file) {
+            exr.emplace(exr_file.get(), width, height, tile_size);
+        }
+        const auto write_tile = [&](const tile& tile_) {
+            if (rgbe) {
+                rgbe->write_tile(canvas, tile_);
+            }
+            if (exr) {
+                exr->write_tile(canvas, tile_);
+            }
+        };
+        if (threads > 0) {
+            // Trace on a pool, while this thread writes out the finished tiles
+            priority_thread_pool pool{threads};
+            tile_stream stream = render_async(pool, ray_tracer{}, scene, canvas, width, height, {}, tile_size);
+            while (const auto tile_ = stream.next()) {
+                write_tile(*tile_);
+            }
+        } else {
+            ray_tracer{}.render(scene, canvas, width, height, never_stop{}, write_tile, tile_size);
+        }
+        if (exr) {
+            exr->finish();
+        }
+        hdr_file.reset();
+        exr_file.reset();
+        const auto pixels = tonemap(canvas, quantise);
+        stbi_write_png("render-rt.png", width, height, 4, pixels.data(), width * 4);
+        return 0;
+    }
+
+    shadow_cache cache{};
+
     const auto image = [&] {
-        ray_tracer r{};
+        const ray_tracer r = use_shadow_cache ? ray_tracer{}.with_shadow_cache(cache) : ray_tracer{};
+        if (deadline_ms > 0) {
+            auto res = render_within<dynamic_canvas>(r, scene, width, height,
+                                                     std::chrono::milliseconds{deadline_ms});
+            if (!res.completed.all_full_quality()) {
+                std::fprintf(stderr, "Deadline reached, image rendered at reduced quality\n");
+            }
+            return std::move(res.canvas);
+        }
+        if (crop) {
+            dynamic_canvas canvas{crop->width, crop->height};
+            canvas.set_quantise_options(quantise);
+            r.render_crop(scene, canvas, width, height, *crop);
+            return canvas;
+        }
         dynamic_canvas canvas{width, height};
-        r.render(dynamic_scene{}, canvas, width, height);
+        canvas.set_quantise_options(quantise);
+        if (!workers.empty()) {
+            distributed_stats stats;
+            if (!render_distributed(scene, canvas, width, height, workers, {}, &stats)) {
+                std::fprintf(stderr, "Every worker was lost, so the image is incomplete\n");
+            }
+            for (std::size_t w = 0; w < workers.size(); w++) {
+                std::fprintf(stderr, "%s: %d tiles%s%s\n", workers[w].c_str(), stats.tiles_per_worker[w],
+                             stats.errors[w].empty() ? "" : ", lost: ", stats.errors[w].c_str());
+            }
+            std::fprintf(stderr, "%d tiles, %d reissued\n", stats.tiles, stats.reissued);
+            return canvas;
+        }
+        if (wavefront) {
+            wavefront_tracer{r}.render(scene, canvas, width, height);
+            return canvas;
+        }
+        if (instances > 0) {
+            r.render(make_instanced_scene(instances), canvas, width, height);
+            return canvas;
+        }
+        if (half_framebuffer) {
+            half_canvas hdr{width, height};
+            r.render(scene, hdr, width, height);
+            hdr.copy_to(canvas);
+            return canvas;
+        }
+        if (threads > 0) {
+            render_parallel(r, scene, canvas, width, height, threads);
+            return canvas;
+        }
+        r.render(scene, canvas, width, height);
         return canvas;
     }();
+    if (use_shadow_cache) {
+        const auto& stats = cache.get_stats();
+        std::fprintf(stderr, "Shadow cache: %llu shadow rays, %llu occluded, %llu found by cached occluder (%.1f%%)\n",
+                     static_cast<unsigned long long>(stats.tests), static_cast<unsigned long long>(stats.occluded),
+                     static_cast<unsigned long long>(stats.hits),
+                     stats.occluded ? 100.0 * stats.hits / stats.occluded : 0.0);
+    }
+    if (print_hash) {
+        // A hash of the RGBA pixels, for checking that two renders match
+        const auto* pixels = reinterpret_cast<const std::uint8_t*>(image.get_pixels().data());
+        std::printf("%016llx\n", static_cast<unsigned long long>(
+                fnv1a_hash(pixels, image.get_pixels().size() * image.bpp)));
+    }
     stbi_write_png("render-rt.png", image.width, image.height, 4,
                    image.get_pixels().data(), image.width * image.bpp);
-}
\ No newline at end of file
+}
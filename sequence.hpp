@@ -0,0 +1,186 @@
+
+/*
+ * Animation sequence rendering
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stb_image_write.h"
+
+namespace rt {
+
+struct camera_keyframe {
+    real_t time;
+    vec3 pos;
+    vec3 look_at;
+};
+
+struct motion_keyframe {
+    real_t time;
+    vec3 offset;
+};
+
+// Keyframed translation of a single thing in the scene, relative to its
+// position when the sequence starts
+struct object_motion {
+    std::size_t thing_index;
+    std::vector<motion_keyframe> keys;
+};
+
+struct animation {
+    std::vector<camera_keyframe> camera_path;
+    std::vector<object_motion> motions;
+
+    // Returns the camera at time t, linearly interpolating between keyframes.
+    // Keyframes must be sorted by time.
+    camera get_camera(real_t t) const
+    {
+        const auto [i, k] = locate(camera_path, t);
+        const auto& a = camera_path[i];
+        const auto& b = camera_path[std::min(i + 1, camera_path.size() - 1)];
+        return camera{lerp(a.pos, b.pos, k), lerp(a.look_at, b.look_at, k)};
+    }
+
+    static vec3 get_offset(const object_motion& motion, real_t t)
+    {
+        if (motion.keys.empty()) {
+            return {};
+        }
+        const auto [i, k] = locate(motion.keys, t);
+        const auto& a = motion.keys[i];
+        const auto& b = motion.keys[std::min(i + 1, motion.keys.size() - 1)];
+        return lerp(a.offset, b.offset, k);
+    }
+
+private:
+    static vec3 lerp(const vec3& a, const vec3& b, real_t k)
+    {
+        return a + (k * (b - a));
+    }
+
+    // Returns the index of the last keyframe at or before t (clamped to the
+    // first and last keyframes), and the interpolation factor towards the next
+    template <typename Keyframe>
+    static std::pair<std::size_t, real_t> locate(const std::vector<Keyframe>& keys, real_t t)
+    {
+        std::size_t i = 0;
+        while (i + 1 < keys.size() && keys[i + 1].time <= t) {
+            i++;
+        }
+        if (i + 1 >= keys.size() || t <= keys[i].time) {
+            return {i, 0};
+        }
+        return {i, (t - keys[i].time) / (keys[i + 1].time - keys[i].time)};
+    }
+};
+
+// Frame sink which writes each frame to a numbered PNG, e.g. "frame-0001.png"
+struct png_sequence_writer {
+    std::string prefix;
+
+    template <typename Canvas>
+    void operator()(int frame, const Canvas& canvas) const
+    {
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "-%04d.png", frame);
+        const auto filename = prefix + suffix;
+        stbi_write_png(filename.c_str(), canvas.width, canvas.height, 4,
+                       canvas.get_pixels().data(), canvas.width * canvas.bpp);
+    }
+};
+
+// Frame sink which writes raw RGBA frames back-to-back to a stream, suitable
+// for piping into e.g. `ffmpeg -f rawvideo -pix_fmt rgba -s WxH -i -`
+struct raw_video_writer {
+    std::FILE* out;
+
+    template <typename Canvas>
+    void operator()(int, const Canvas& canvas) const
+    {
+        std::fwrite(canvas.get_pixels().data(), canvas.bpp,
+                    canvas.width * canvas.height, out);
+        std::fflush(out);
+    }
+};
+
+// Renders frame_count frames of an animation at the given frame rate,
+// passing each completed frame to sink(frame_number, canvas).
+//
+// The scene is kept resident across frames: only the camera and the things
+// named by the animation's motions are updated between frames, using the
+// scene's update_things(), so that its acceleration structure is refitted
+// rather than rebuilt. Each frame is handed to the sink on a separate
+// thread, so that encoding frame N overlaps with tracing frame N+1; the sink
+// is never called concurrently with itself.
+template <typename Canvas, typename Scene, typename FrameSink>
+void render_sequence(const ray_tracer& tracer, Scene& scene, const animation& anim,
+                     int width, int height, int frame_count, real_t frame_rate,
+                     FrameSink&& sink)
+{
+    // Motions are relative to the things' starting positions
+    std::vector<any_thing> base_things;
+    std::vector<std::size_t> moving;
+    for (const auto& motion : anim.motions) {
+        base_things.push_back(scene.get_things()[motion.thing_index]);
+        moving.push_back(motion.thing_index);
+    }
+
+    Canvas canvases[2] = {Canvas{width, height}, Canvas{width, height}};
+    std::future<void> encoding;
+
+    for (int frame = 0; frame < frame_count; frame++) {
+        const real_t t = frame / frame_rate;
+        if (!anim.camera_path.empty()) {
+            scene.set_camera(anim.get_camera(t));
+        }
+        if (!moving.empty()) {
+            std::size_t m = 0;
+            scene.update_things(moving, [&](std::size_t, any_thing& thing) {
+                thing = base_things[m];
+                thing.translate(animation::get_offset(anim.motions[m], t));
+                m++;
+            });
+        }
+
+        // The canvas we're about to draw into was last used two frames ago,
+        // and its encode was waited for once the previous frame was traced
+        Canvas& canvas = canvases[frame % 2];
+        tracer.render(scene, canvas, width, height);
+
+        if (encoding.valid()) {
+            encoding.get();
+        }
+        encoding = std::async(std::launch::async, [&sink, &canvas, frame] {
+            sink(frame, canvas);
+        });
+    }
+
+    if (encoding.valid()) {
+        encoding.get();
+    }
+}
+
+} // end namespace rt
@@ -0,0 +1,50 @@
+
+/*
+ * Detection of the SIMD instruction sets available for run-time kernels
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+// AVX2 kernels are compiled for AVX2 regardless of the build flags, and
+// only called if the CPU turns out to support it
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RAYTRACER_HAVE_AVX2_KERNEL
+#include <immintrin.h>
+#endif
+
+// SSE2 is part of x86-64, so SSE2 kernels are used whenever the build
+// allows them
+#if defined(__SSE2__)
+#define RAYTRACER_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace rt {
+namespace detail {
+
+#ifdef RAYTRACER_HAVE_AVX2_KERNEL
+
+inline bool cpu_has_avx2()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+#endif // RAYTRACER_HAVE_AVX2_KERNEL
+
+} // end namespace detail
+} // end namespace rt
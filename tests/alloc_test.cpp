@@ -0,0 +1,201 @@
+#include "dynamic_scene.hpp"
+#include "wavefront.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+// Checks that once a scene has been built and rendered once, further
+// renders (recursive and wavefront) and refits of moved things make no heap
+// allocations: everything they need comes from the scene's arena or the
+// tracer's scratch arena, which keep their blocks.
+
+namespace {
+
+long allocation_count = 0;
+
+} // end anonymous namespace
+
+// Every replaceable allocation function is counted: the aligned forms are
+// what allocate over-aligned types such as wide_bvh nodes, and the nothrow
+// and array forms call these.
+
+void* operator new(std::size_t size)
+{
+    allocation_count++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    allocation_count++;
+    // aligned_alloc wants a size which is a multiple of the alignment
+    const auto a = static_cast<std::size_t>(align);
+    if (void* p = std::aligned_alloc(a, (std::max<std::size_t>(size, 1) + a - 1) / a * a)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+void* operator new[](std::size_t size, std::align_val_t align) { return operator new(size, align); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    try {
+        return operator new(size, align);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    return operator new(size, align, std::nothrow);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+using namespace rt;
+
+namespace {
+
+constexpr int width = 256;
+constexpr int height = 256;
+
+int failures = 0;
+
+// Fails if func allocates
+template <typename Func>
+void expect_no_allocations(const char* name, Func&& func)
+{
+    const long before = allocation_count;
+    func();
+    const long count = allocation_count - before;
+    std::printf("%s: %ld allocations\n", name, count);
+    if (count != 0) {
+        std::printf("FAILED: %s allocated\n", name);
+        failures++;
+    }
+}
+
+// Runs func once to warm up, then fails if it allocates the second time
+template <typename Func>
+void expect_steady_state(const char* name, Func&& func)
+{
+    func();
+    expect_no_allocations(name, func);
+}
+
+} // end anonymous namespace
+
+int main()
+{
+    // Check that over-aligned allocations, like those of wide_bvh nodes,
+    // are counted
+    {
+        const long before = allocation_count;
+        auto* mr = std::pmr::new_delete_resource();
+        mr->deallocate(mr->allocate(sizeof(wide_bvh<8>::node), alignof(wide_bvh<8>::node)),
+                       sizeof(wide_bvh<8>::node), alignof(wide_bvh<8>::node));
+        if (allocation_count - before != 1) {
+            std::printf("FAILED: an aligned allocation was not counted\n");
+            failures++;
+        }
+    }
+
+    // An arena reset after allocations that spilled into several blocks
+    // must then fit any sequence of up to the same total size, even one
+    // which would have left the ends of those blocks unused
+    {
+        arena a{64 * 1024};
+        const auto allocate = [&](std::initializer_list<std::size_t> sizes) {
+            for (const std::size_t size : sizes) {
+                static_cast<void>(a.allocate(size));
+            }
+        };
+        allocate({40 * 1024, 40 * 1024});
+        a.reset();
+        expect_no_allocations("arena with a different sequence",
+                              [&] { allocate({30 * 1024, 50 * 1024, 30 * 1024}); });
+    }
+
+    auto scene = dynamic_scene::with_sphere_field(500);
+    dynamic_canvas canvas{width, height};
+
+    const ray_tracer tracer{};
+    expect_steady_state("recursive render", [&] { tracer.render(scene, canvas, width, height); });
+
+    wavefront_tracer wavefront{tracer};
+    expect_steady_state("wavefront render", [&] { wavefront.render(scene, canvas, width, height); });
+
+    const std::vector<std::size_t> moving{5, 6, 7};
+    expect_no_allocations("update_things", [&] {
+        for (int frame = 0; frame < 10; frame++) {
+            scene.update_things(moving, [](std::size_t, any_thing& thing) { thing.translate({0.01, 0, 0}); });
+        }
+    });
+
+    // Refits mustn't have left the renders allocating either
+    expect_no_allocations("recursive render after refits", [&] { tracer.render(scene, canvas, width, height); });
+    expect_no_allocations("wavefront render after refits", [&] { wavefront.render(scene, canvas, width, height); });
+
+    // Nor may views the renders weren't warmed up on: orbit the camera, with
+    // tiles large enough to spill over several arena blocks and sizes which
+    // vary, then render from positions in between those of the warm-up
+    wavefront_tracer tiled{tracer, 192};
+    const auto orbit = [&](real_t start) {
+        for (int i = 0; i < 4; i++) {
+            const real_t angle = start + real_t{1.5708} * i;
+            scene.set_camera(camera{vec3{5 * std::cos(angle), 2.0, 5 * std::sin(angle)}, vec3{-1.0, 0.5, 0.0}});
+            tracer.render(scene, canvas, width, height);
+            tiled.render(scene, canvas, width, height);
+        }
+    };
+    orbit(0);
+    expect_no_allocations("renders from a moved camera", [&] { orbit(real_t{0.7854}); });
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+#include "dynamic_scene.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+
+// Checks that a dynamic_scene assigned over another renders and refits the
+// same as the scene it was assigned from, including after that scene has
+// been destroyed: the assigned scene must not hold memory from either the
+// arena it replaced or the other scene's.
+
+using namespace rt;
+
+namespace {
+
+constexpr int width = 64;
+constexpr int height = 64;
+
+// The rendered image's bytes
+std::vector<std::uint8_t> render(const dynamic_scene& scene)
+{
+    dynamic_canvas canvas{width, height};
+    ray_tracer{}.render(scene, canvas, width, height);
+    const auto& pixels = canvas.get_pixels();
+    const auto* bytes = reinterpret_cast<const std::uint8_t*>(pixels.data());
+    return {bytes, bytes + pixels.size() * dynamic_canvas::bpp};
+}
+
+void move_spheres(dynamic_scene& scene)
+{
+    const std::vector<std::size_t> moving{3, 4, 5};
+    scene.update_things(moving, [](std::size_t, any_thing& thing) { thing.translate({0.05, 0, 0}); });
+}
+
+} // end anonymous namespace
+
+int main()
+{
+    int failures = 0;
+
+    for (const auto index : {spatial_index::bvh, spatial_index::grid, spatial_index::compressed_bvh,
+                             spatial_index::wide_bvh}) {
+        auto expected_scene = dynamic_scene::with_sphere_volume(100, index);
+        const auto expected = render(expected_scene);
+        move_spheres(expected_scene);
+        const auto expected_moved = render(expected_scene);
+
+        auto scene = dynamic_scene::with_sphere_field(200);
+        render(scene);
+        {
+            auto other = dynamic_scene::with_sphere_volume(100, index);
+            scene = std::move(other);
+        }
+        if (render(scene) != expected) {
+            std::printf("FAILED: assigned scene rendered differently\n");
+            failures++;
+        }
+        move_spheres(scene);
+        if (render(scene) != expected_moved) {
+            std::printf("FAILED: assigned scene rendered differently after a refit\n");
+            failures++;
+        }
+    }
+
+    // A move-constructed scene must be assignable too, more than once
+    auto first = dynamic_scene::with_sphere_field(100);
+    dynamic_scene second{std::move(first)};
+    second = dynamic_scene::with_sphere_field(200);
+    second = dynamic_scene::with_sphere_volume(100);
+    if (render(second) != render(dynamic_scene::with_sphere_volume(100))) {
+        std::printf("FAILED: reassigned scene rendered differently\n");
+        failures++;
+    }
+
+    std::printf("%s\n", failures == 0 ? "passed" : "failed");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
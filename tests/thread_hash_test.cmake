@@ -0,0 +1,28 @@
+# Renders the reference scene on 1, 2, 7 and 64 threads, and fails unless
+# all four images hash the same, and (if EXPECTED_HASH is given) match the
+# checked-in hash.
+#
+# Usage: cmake -DRAYTRACER_RT=<raytracer-rt> [-DEXPECTED_HASH=<hash>] -P thread_hash_test.cmake
+
+foreach(threads 1 2 7 64)
+    execute_process(COMMAND ${RAYTRACER_RT} --threads ${threads} --hash
+                    OUTPUT_VARIABLE output
+                    RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "raytracer-rt --threads ${threads} failed: ${result}")
+    endif()
+    # The hash is the last line printed
+    string(STRIP "${output}" output)
+    string(REGEX MATCH "[0-9a-f]+$" hash "${output}")
+    message(STATUS "${threads} threads: ${hash}")
+
+    if (NOT DEFINED first_hash)
+        set(first_hash ${hash})
+    elseif (NOT hash STREQUAL first_hash)
+        message(FATAL_ERROR "${threads} threads gave ${hash}, but 1 thread gave ${first_hash}")
+    endif()
+endforeach()
+
+if (DEFINED EXPECTED_HASH AND NOT first_hash STREQUAL EXPECTED_HASH)
+    message(FATAL_ERROR "Rendered ${first_hash}, expected ${EXPECTED_HASH}")
+endif()
@@ -0,0 +1,104 @@
+#include "wide_bvh.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Checks that the unused child slots of wide_bvh nodes with fewer than
+// eight children miss every ray by their bounds alone, without relying on
+// the child_count mask, and that traversal through such nodes finds the
+// same hits as testing every thing.
+
+using namespace rt;
+
+namespace {
+
+int failures = 0;
+
+// The slab test done by wide_bvh's kernels, for one child and without the
+// child_count mask
+bool slab_hit(const wide_bvh<8>::node& n, int c, const ray& ray_)
+{
+    const vec3 inv_dir{real_t{1} / ray_.dir.x, real_t{1} / ray_.dir.y, real_t{1} / ray_.dir.z};
+    real_t tmin = -no_hit;
+    real_t tmax = no_hit;
+    for (int a = 0; a < 3; a++) {
+        const real_t t1 = (n.lower[a][c] - detail::axis(ray_.start, a)) * detail::axis(inv_dir, a);
+        const real_t t2 = (n.upper[a][c] - detail::axis(ray_.start, a)) * detail::axis(inv_dir, a);
+        tmin = std::max(tmin, std::min(t1, t2));
+        tmax = std::min(tmax, std::max(t1, t2));
+    }
+    return tmax >= tmin && tmax >= 0 && tmin < no_hit;
+}
+
+// Rays from a grid of points through and around the scene, along the axes
+// (whose zero components give infinite inverse directions) and diagonals
+std::vector<ray> make_rays()
+{
+    std::vector<ray> rays;
+    const vec3 dirs[] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1},
+                         norm(vec3{1, 1, 1}), norm(vec3{-1, 1, -1}), norm(vec3{1, -1, 0.5}),
+                         norm(vec3{-0.3, -1, -1})};
+    for (int x = -2; x <= 12; x++) {
+        for (int y = -2; y <= 4; y++) {
+            for (int z = -2; z <= 4; z++) {
+                for (const vec3& d : dirs) {
+                    rays.push_back({vec3{real_t(x), real_t(y), real_t(z)} + real_t{0.5} * d, d});
+                }
+            }
+        }
+    }
+    return rays;
+}
+
+} // end anonymous namespace
+
+int main()
+{
+    // Eleven small spheres in a row, so that the tree has nodes with fewer
+    // than eight children, and gaps between them which the unused slots
+    // would cover if their bounds were hit
+    std::vector<any_thing> things;
+    for (int i = 0; i < 11; i++) {
+        things.emplace_back(sphere{{real_t(i), real_t(i % 3), real_t(i % 2)}, real_t{0.3}, surfaces::shiny});
+    }
+    const bvh tree{things};
+    const wide_bvh<8> wide{tree};
+    const auto rays = make_rays();
+
+    int partial_nodes = 0;
+    for (const auto& n : wide.get_nodes()) {
+        if (n.child_count == 8) {
+            continue;
+        }
+        partial_nodes++;
+        for (int c = n.child_count; c < 8; c++) {
+            for (const ray& r : rays) {
+                if (slab_hit(n, c, r)) {
+                    std::printf("FAILED: unused child %d of a %d-child node was hit\n", c, n.child_count);
+                    failures++;
+                    break;
+                }
+            }
+        }
+    }
+    std::printf("%d nodes with fewer than 8 children\n", partial_nodes);
+    if (partial_nodes == 0) {
+        std::printf("FAILED: no node has fewer than 8 children\n");
+        failures++;
+    }
+
+    for (const ray& r : rays) {
+        real_t expected = no_hit;
+        for (const auto& t : things) {
+            expected = std::min(expected, t.intersect(r));
+        }
+        const auto isect = wide.intersect(r, things);
+        if ((isect.dist == no_hit) != (expected == no_hit) || (isect && isect.dist != expected)) {
+            std::printf("FAILED: hit at %g, expected %g\n", double(isect.dist), double(expected));
+            failures++;
+        }
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
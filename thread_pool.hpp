@@ -0,0 +1,134 @@
+
+/*
+ * A thread pool with prioritised tasks
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rt {
+
+// A fixed set of worker threads running tasks from a shared queue. Queued
+// tasks of higher priority run first, and tasks of equal priority run in the
+// order they were submitted; running tasks are never interrupted.
+class priority_thread_pool {
+public:
+    explicit priority_thread_pool(int threads = int(std::thread::hardware_concurrency()))
+    {
+        for (int i = 0; i < std::max(threads, 1); i++) {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+
+    priority_thread_pool(const priority_thread_pool&) = delete;
+    priority_thread_pool& operator=(const priority_thread_pool&) = delete;
+
+    // Runs any tasks which are still queued, then joins the threads
+    ~priority_thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void submit(int priority, std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            queue_.push_back({priority, next_seq_++, std::move(fn)});
+            std::push_heap(queue_.begin(), queue_.end(), runs_later{});
+        }
+        ready_.notify_one();
+    }
+
+    int get_thread_count() const { return int(threads_.size()); }
+
+private:
+    struct task {
+        int priority;
+        std::uint64_t seq;
+        std::function<void()> fn;
+    };
+
+    // Orders the heap so that its front is the next task to run
+    struct runs_later {
+        bool operator()(const task& a, const task& b) const
+        {
+            return a.priority != b.priority ? a.priority < b.priority : a.seq > b.seq;
+        }
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        while (true) {
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            std::pop_heap(queue_.begin(), queue_.end(), runs_later{});
+            task t = std::move(queue_.back());
+            queue_.pop_back();
+            lock.unlock();
+            t.fn();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::vector<task> queue_;
+    std::uint64_t next_seq_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+namespace detail {
+
+// Splits [0, count) into up to thread_count contiguous chunks and calls
+// fn(chunk, begin, end) for each, one on the calling thread and the rest on
+// threads of their own, returning once all have finished. For one-off bulk
+// work, such as building acceleration structures, where a pool isn't to hand.
+template <typename Func>
+void parallel_chunks(int thread_count, std::size_t count, Func&& fn)
+{
+    const std::size_t chunks = std::max<std::size_t>(std::min(std::size_t(std::max(thread_count, 1)), count), 1);
+    std::vector<std::thread> threads;
+    for (std::size_t c = 1; c < chunks; c++) {
+        threads.emplace_back([&fn, c, chunks, count] { fn(c, count * c / chunks, count * (c + 1) / chunks); });
+    }
+    fn(std::size_t{0}, std::size_t{0}, count / chunks);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+} // end namespace detail
+} // end namespace rt
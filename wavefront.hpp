@@ -0,0 +1,357 @@
+
+/*
+ * Breadth-first ("wavefront") ray tracing
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "arena.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+// Renders the same image as ray_tracer, but breadth-first rather than
+// depth-first.
+//
+// Within each tile, all the rays of one bounce level are collected into a
+// queue and sorted by a key made of their direction octant and the Morton
+// code of their origin, so that neighbouring rays in the queue tend to
+// visit the same parts of the scene. The shadow rays for every hit at that
+// level are then queued and sorted in the same way, and finally the hits are
+// shaded grouped by material. Once every level has been traced, the colours
+// are folded back up from the deepest level, in exactly the order the
+// recursive tracer combines them, so the result is bit-identical.
+//
+// The queues for each tile are allocated from an arena which is reset once
+// the tile is finished, so after the first few tiles rendering allocates no
+// memory at all. A wavefront_tracer is therefore not safe to share between
+// threads.
+class wavefront_tracer {
+public:
+    struct stats {
+        std::uint64_t primary_rays = 0;
+        std::uint64_t reflection_rays = 0;
+        std::uint64_t shadow_rays = 0;
+    };
+
+    wavefront_tracer() = default;
+
+    explicit wavefront_tracer(const ray_tracer& tracer, int tile_size = 128)
+            : tracer_{tracer},
+              tile_size_{tile_size}
+    {}
+
+    template <typename Scene, typename Canvas>
+    void render(const Scene& scene, Canvas& canvas, int width, int height)
+    {
+        for (int y = 0; y < height; y += tile_size_) {
+            for (int x = 0; x < width; x += tile_size_) {
+                render_tile(scene, canvas, width, height,
+                            {x, y, std::min(tile_size_, width - x), std::min(tile_size_, height - y)});
+            }
+        }
+    }
+
+    template <typename Scene, typename Canvas>
+    void render_tile(const Scene& scene, Canvas& canvas, int width, int height, const tile& tile_)
+    {
+        const auto n_pixels = std::uint32_t(tile_.width * tile_.height);
+        const int max_depth = tracer_.max_depth;
+        buffers& buf = buf_.emplace(&scratch_, n_pixels, max_depth);
+
+        const camera_ray_generator gen{scene.get_camera(), width, height};
+        buf.dirs.resize(n_pixels);
+        gen.generate_tile(tile_, 1, buf.dirs.data());
+
+        for (std::uint32_t i = 0; i < n_pixels; i++) {
+            buf.rays.push_back({{gen.get_origin(), buf.dirs[i]}, i});
+        }
+        stats_.primary_rays += n_pixels;
+        buf.pixel_hit.assign(n_pixels, no_index);
+
+        int depth = 0;
+        for (; depth <= max_depth && !buf.rays.empty(); depth++) {
+            if (depth > 0) {
+                stats_.reflection_rays += buf.rays.size();
+            }
+            trace_level(scene, depth);
+        }
+
+        // Fold the colours back up, deepest level first
+        for (int d = depth - 1; d >= 0; d--) {
+            for (auto& h : buf.levels[d]) {
+                const color reflected = d >= max_depth ? color::grey()
+                        : scale(h.reflect, h.child != no_index ? buf.levels[d + 1][h.child].result
+                                                            : color::background());
+                h.result = h.natural + reflected;
+            }
+        }
+
+        const auto get_color = [&](std::uint32_t i) {
+            return buf.pixel_hit[i] != no_index ? buf.levels[0][buf.pixel_hit[i]].result
+                                                : color::background();
+        };
+        if constexpr (detail::has_set_pixels<Canvas>::value) {
+            buf.row.resize(tile_.width);
+            for (int y = 0; y < tile_.height; y++) {
+                for (int x = 0; x < tile_.width; x++) {
+                    buf.row[x] = get_color(std::uint32_t(y * tile_.width + x));
+                }
+                canvas.set_pixels(tile_.x, tile_.y + y, buf.row.data(), tile_.width);
+            }
+        } else {
+            for (std::uint32_t i = 0; i < n_pixels; i++) {
+                canvas.set_pixel(tile_.x + int(i) % tile_.width, tile_.y + int(i) / tile_.width,
+                                 get_color(i));
+            }
+        }
+
+        buf_.reset();
+        scratch_.reset();
+    }
+
+    // The amount of scratch memory held for tracing tiles
+    std::size_t get_scratch_capacity() const { return scratch_.get_capacity(); }
+
+    const stats& get_stats() const { return stats_; }
+
+private:
+    static constexpr std::uint32_t no_index = ~std::uint32_t{0};
+
+    struct queued_ray {
+        ray ray_;
+        // The index of the hit in the previous level which spawned this
+        // ray, or for primary rays the index of the pixel within the tile
+        std::uint32_t parent;
+    };
+
+    struct shadow_ray {
+        ray ray_;
+        real_t light_dist;
+        std::uint32_t id; // index into buffers::hit_lights
+    };
+
+    struct hit {
+        const any_thing* thing;
+        vec3 pos;
+        vec3 normal;
+        vec3 reflect_dir;
+        std::uint32_t parent;
+        std::uint32_t child = no_index;
+        std::uint32_t first_light = 0; // this hit's lights in buffers::hit_lights
+        std::uint32_t n_lights = 0;
+        real_t reflect = 0;
+        color natural{};
+        color result{};
+    };
+
+    template <typename T>
+    using vector = std::pmr::vector<T>;
+
+    // The queues for a single tile, all allocated from the scratch arena
+    struct buffers {
+        buffers(std::pmr::memory_resource* mr, std::uint32_t n_pixels, int max_depth)
+                : dirs(mr), rays(mr), next_rays(mr), shadow_rays(mr), sorted_shadow_rays(mr),
+                  hit_lights(mr), levels(mr), pixel_hit(mr), in_shadow(mr), keys(mr),
+                  by_material(mr), row(mr)
+        {
+            rays.reserve(n_pixels);
+            next_rays.reserve(n_pixels);
+            keys.reserve(n_pixels);
+            by_material.reserve(n_pixels);
+            levels.resize(max_depth + 1);
+        }
+
+        vector<vec3> dirs;
+        vector<queued_ray> rays;
+        vector<queued_ray> next_rays;
+        vector<shadow_ray> shadow_rays;
+        vector<shadow_ray> sorted_shadow_rays;
+        vector<light> hit_lights;
+        vector<vector<hit>> levels;
+        vector<std::uint32_t> pixel_hit;
+        vector<bool> in_shadow;
+        vector<std::pair<std::uint64_t, std::uint32_t>> keys;
+        vector<std::pair<const surface*, std::uint32_t>> by_material;
+        vector<color> row; // one row of the finished tile
+    };
+
+    static std::uint32_t expand_bits(std::uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Sorts rays by direction octant, then by the Morton code of their
+    // origin within the bounding box of all the origins. The sorted rays are
+    // gathered into spare, which is then swapped with rays.
+    template <typename Ray>
+    void sort_rays(vector<Ray>& rays, vector<Ray>& spare)
+    {
+        if (rays.size() < 2) {
+            return;
+        }
+        aabb bounds = aabb::empty();
+        for (const auto& r : rays) {
+            bounds.expand(r.ray_.start);
+        }
+        const vec3 extent = bounds.upper - bounds.lower;
+        const auto cell_scale = [](real_t e) { return e > 0 ? real_t{1023.0} / e : real_t{0}; };
+        const vec3 scale{cell_scale(extent.x), cell_scale(extent.y), cell_scale(extent.z)};
+
+        auto& keys = buf_->keys;
+        keys.clear();
+        for (std::uint32_t i = 0; i < rays.size(); i++) {
+            const ray& r = rays[i].ray_;
+            const auto octant = std::uint64_t((r.dir.x < 0) | (r.dir.y < 0) << 1 | (r.dir.z < 0) << 2);
+            const auto cell = expand_bits(std::uint32_t((r.start.x - bounds.lower.x) * scale.x)) |
+                              expand_bits(std::uint32_t((r.start.y - bounds.lower.y) * scale.y)) << 1 |
+                              expand_bits(std::uint32_t((r.start.z - bounds.lower.z) * scale.z)) << 2;
+            keys.emplace_back(octant << 30 | cell, i);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        spare.clear();
+        for (const auto& k : keys) {
+            spare.push_back(rays[k.second]);
+        }
+        rays.swap(spare);
+    }
+
+    // Orders surfaces by material. Every thing holds its own copy of its
+    // surface, so things share a material when their surfaces have the same
+    // functions and roughness (as detail::find_surface() in
+    // render_protocol.hpp matches them), not when they share an address.
+    static bool material_less(const surface& a, const surface& b)
+    {
+        if (a.diffuse != b.diffuse) {
+            return std::less<surface::diffuse_func_t>{}(a.diffuse, b.diffuse);
+        }
+        if (a.specular != b.specular) {
+            return std::less<surface::specular_func_t>{}(a.specular, b.specular);
+        }
+        if (a.reflect != b.reflect) {
+            return std::less<surface::reflect_func_t>{}(a.reflect, b.reflect);
+        }
+        return a.roughness < b.roughness;
+    }
+
+    template <typename Scene>
+    void trace_level(const Scene& scene, int depth)
+    {
+        buffers& buf = *buf_;
+        sort_rays(buf.rays, buf.next_rays);
+
+        auto& hits = buf.levels[depth];
+        hits.reserve(buf.rays.size());
+        for (const auto& r : buf.rays) {
+            if (const auto isect = tracer_.get_intersections(r.ray_, scene)) {
+                const vec3& d = r.ray_.dir;
+                const vec3 pos = (isect.dist * d) + r.ray_.start;
+                const vec3 normal = ray_tracer::get_normal(isect, pos);
+                const vec3 reflect_dir = d - (2 * (dot(normal, d) * normal));
+                const auto idx = std::uint32_t(hits.size());
+                hits.push_back({isect.thing_, pos, normal, reflect_dir, r.parent});
+                if (depth == 0) {
+                    buf.pixel_hit[r.parent] = idx;
+                } else {
+                    buf.levels[depth - 1][r.parent].child = idx;
+                }
+            }
+        }
+
+        // Queue, sort and trace the shadow rays for every light at every hit
+        buf.hit_lights.clear();
+        buf.shadow_rays.clear();
+        for (auto& hit_ : hits) {
+            hit_.first_light = std::uint32_t(buf.hit_lights.size());
+            ray_tracer::for_each_light(scene, hit_.pos, [&](const light& light_) {
+                if (light_.col.r == 0 && light_.col.g == 0 && light_.col.b == 0) {
+                    return;
+                }
+                const vec3 ldis = light_.pos - hit_.pos;
+                const vec3 livec = norm(ldis);
+                // As in ray_tracer::add_light(), the thing hides lights behind it
+                if (dot(livec, hit_.normal) <= 0) {
+                    return;
+                }
+                buf.shadow_rays.push_back({ray_tracer::leaving_ray(hit_.pos, hit_.normal, livec), mag(ldis),
+                                           std::uint32_t(buf.hit_lights.size())});
+                buf.hit_lights.push_back(light_);
+            });
+            hit_.n_lights = std::uint32_t(buf.hit_lights.size()) - hit_.first_light;
+        }
+        stats_.shadow_rays += buf.shadow_rays.size();
+        sort_rays(buf.shadow_rays, buf.sorted_shadow_rays);
+        buf.in_shadow.assign(buf.shadow_rays.size(), false);
+        for (const auto& sr : buf.shadow_rays) {
+            buf.in_shadow[sr.id] = tracer_.is_in_shadow(sr.ray_, sr.light_dist,
+                                                        buf.hit_lights[sr.id].pos, scene, depth);
+        }
+
+        // Shade the hits grouped by material, queueing the reflection rays
+        buf.by_material.clear();
+        for (std::uint32_t h = 0; h < hits.size(); h++) {
+            buf.by_material.emplace_back(&hits[h].thing->get_surface(), h);
+        }
+        std::sort(buf.by_material.begin(), buf.by_material.end(), [](const auto& a, const auto& b) {
+            if (material_less(*a.first, *b.first)) {
+                return true;
+            }
+            return !material_less(*b.first, *a.first) && a.second < b.second;
+        });
+
+        buf.next_rays.clear();
+        for (const auto& [surf, h] : buf.by_material) {
+            hit& hit_ = hits[h];
+            color col = color::default_color();
+            for (auto l = hit_.first_light; l < hit_.first_light + hit_.n_lights; l++) {
+                if (!buf.in_shadow[l]) {
+                    const light& light_ = buf.hit_lights[l];
+                    const vec3 livec = norm(light_.pos - hit_.pos);
+                    col = tracer_.add_unshadowed_light(*hit_.thing, hit_.pos, hit_.normal,
+                                                       hit_.reflect_dir, col, light_, livec);
+                }
+            }
+            hit_.natural = color::background() + col;
+            if (depth < tracer_.max_depth) {
+                hit_.reflect = surf->reflect(hit_.pos);
+                buf.next_rays.push_back({ray_tracer::leaving_ray(hit_.pos, hit_.normal, hit_.reflect_dir), h});
+            }
+        }
+        buf.rays.swap(buf.next_rays);
+    }
+
+    ray_tracer tracer_{};
+    int tile_size_ = 128;
+    stats stats_{};
+
+    arena scratch_{1024 * 1024};
+    std::optional<buffers> buf_; // only engaged while rendering a tile
+};
+
+} // end namespace rt
@@ -0,0 +1,652 @@
+
+/*
+ * Wide BVHs, collapsed from a binary BVH
+ */
+
+ /*
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+
+#pragma once
+
+#include "raytracer.hpp"
+#include "bvh.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+namespace detail {
+
+inline real_t axis(const vec3& v, int a)
+{
+    return a == 0 ? v.x : a == 1 ? v.y : v.z;
+}
+
+// Gathers up to Width children for a node of a wide tree from the binary
+// node idx, by repeatedly replacing the interior child with the largest
+// surface area by its two children. A leaf yields itself as its only child.
+// Returns the number of children.
+//
+// The binary tree's leaves are kept as they are. Merging small subtrees
+// into bigger leaves fills the wide nodes better and shrinks the tree
+// severalfold, but traces large scenes more slowly, since each extra thing
+// tested is usually a cache miss.
+template <int Width>
+int collapse_children(const bvh& tree, std::uint32_t idx, std::uint32_t (&children)[Width])
+{
+    const auto& nodes = tree.get_nodes();
+    if (nodes[idx].is_leaf()) {
+        children[0] = idx;
+        return 1;
+    }
+    children[0] = nodes[idx].left_first;
+    children[1] = nodes[idx].left_first + 1;
+    int count = 2;
+    while (count < Width) {
+        int widest = -1;
+        real_t widest_area = -1;
+        for (int c = 0; c < count; c++) {
+            const auto& n = nodes[children[c]];
+            if (!n.is_leaf() && n.bounds.surface_area() > widest_area) {
+                widest = c;
+                widest_area = n.bounds.surface_area();
+            }
+        }
+        if (widest < 0) {
+            break;
+        }
+        const std::uint32_t left = nodes[children[widest]].left_first;
+        children[widest] = left;
+        children[count++] = left + 1;
+    }
+    return count;
+}
+
+// Collapses a binary bvh into a tree with up to Width children per node,
+// appending its nodes to nodes and the indices of its bounded things to
+// prims, and calling set_bounds(node, bounds, child_bounds) to store each
+// node's children's bounds. Each node is allotted its slot when its parent
+// is built, so that siblings sit together.
+template <int Width, typename Node, typename SetBounds>
+void collapse_bvh(const bvh& tree, std::pmr::vector<Node>& nodes_out, std::pmr::vector<std::uint32_t>& prims,
+                  SetBounds&& set_bounds)
+{
+    static_assert(bvh::max_leaf_size <= 7 && (Width - 1) * bvh::max_leaf_size < 32,
+                  "leaf sizes must fit in 3 bits, and leaf offsets in 5");
+
+    const auto& bin_nodes = tree.get_nodes();
+    if (bin_nodes.empty()) {
+        return;
+    }
+
+    // pending holds the binary node each allotted slot is to be built from.
+    // It is a depth-first stack, so like the traversal stack it holds at
+    // most Width - 1 entries per level of the binary tree. Building straight
+    // into nodes_out reuses its capacity, so that refitted trees can be
+    // collapsed again without allocating.
+    auto& nodes = nodes_out;
+    nodes.resize(1);
+    std::pair<std::uint32_t, std::uint32_t> pending[64 * (Width - 1) + 1];
+    int pending_size = 0;
+    pending[pending_size++] = {0, 0};
+    prims.reserve(tree.get_prims().size());
+    while (pending_size > 0) {
+        const auto [bin_idx, wide_idx] = pending[--pending_size];
+
+        std::uint32_t children[Width];
+        const int count = collapse_children<Width>(tree, bin_idx, children);
+
+        Node n{};
+        n.child_count = std::uint8_t(count);
+        n.child_base = std::uint32_t(nodes.size());
+        n.prim_base = std::uint32_t(prims.size());
+        aabb child_bounds[Width];
+        aabb bounds = aabb::empty();
+        std::uint32_t n_interior = 0;
+        for (int c = 0; c < count; c++) {
+            const auto& child = bin_nodes[children[c]];
+            child_bounds[c] = child.bounds;
+            bounds.expand(child.bounds);
+            if (child.is_leaf()) {
+                n.meta[c] = std::uint8_t(child.count << 5 | (prims.size() - n.prim_base));
+                for (std::uint32_t p = child.left_first; p < child.left_first + child.count; p++) {
+                    prims.push_back(tree.get_prims()[p]);
+                }
+            } else {
+                n.meta[c] = std::uint8_t(n_interior);
+                pending[pending_size++] = {children[c], n.child_base + n_interior++};
+            }
+        }
+        set_bounds(n, bounds, child_bounds);
+        nodes.resize(nodes.size() + n_interior);
+        nodes[wide_idx] = n;
+    }
+}
+
+// Traverses a tree built by collapse_bvh(), looking for things hit closer
+// than max_dist: the closest of them, or if AnyHit, the first found.
+// hit_children(node, inv_dir, max_dist, dist) slab-tests the ray against
+// the node's children, returning a mask of those hit before max_dist, with
+// their entry distances in dist. Children are visited in order of entry
+// distance, and leaves are pushed along with nodes, so that they are too.
+template <bool AnyHit, int Width, typename Node, typename Things, typename HitChildren>
+intersection traverse_wide(const std::pmr::vector<Node>& nodes, const std::pmr::vector<std::uint32_t>& prims,
+                           const unbounded_list& unbounded, const ray& ray_,
+                           const Things& things, real_t max_dist, HitChildren&& hit_children)
+{
+    intersection closest{};
+    real_t closest_dist = max_dist;
+
+    unbounded.intersect(ray_, things, closest, closest_dist);
+    if (AnyHit && closest) {
+        return closest;
+    }
+
+    if (nodes.empty()) {
+        return closest;
+    }
+
+    const vec3 inv_dir{real_t{1} / ray_.dir.x, real_t{1} / ray_.dir.y, real_t{1} / ray_.dir.z};
+    struct entry {
+        std::uint32_t index;
+        std::uint32_t count; // zero for nodes
+        real_t dist;
+    };
+    // The tree is no deeper than the binary tree it was collapsed from (see
+    // bvh::max_sah_depth), and each level leaves at most Width - 1 entries
+    // on the stack
+    entry stack[64 * (Width - 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, 0};
+
+    while (stack_size > 0) {
+        const entry e = stack[--stack_size];
+        if (e.dist >= closest_dist) {
+            continue;
+        }
+        if (e.count != 0) {
+            for (std::uint32_t p = e.index; p < e.index + e.count; p++) {
+                test_closer(things[prims[p]], ray_, closest, closest_dist);
+                if (AnyHit && closest) {
+                    return closest;
+                }
+            }
+            continue;
+        }
+
+        const Node& n = nodes[e.index];
+        real_t dist[Width];
+        const unsigned mask = hit_children(n, inv_dir, closest_dist, dist);
+
+        // Push the children which were hit in order of distance, the
+        // furthest first, so that the nearest is visited next
+        const int first_hit = stack_size;
+        for (int c = 0; c < n.child_count; c++) {
+            if (!(mask & (1u << c))) {
+                continue;
+            }
+            const std::uint32_t offset = n.meta[c] & 31u;
+            const entry h = n.is_leaf(c) ? entry{n.prim_base + offset, std::uint32_t(n.meta[c] >> 5), dist[c]}
+                                         : entry{n.child_base + offset, 0, dist[c]};
+            int i = stack_size++;
+            for (; i > first_hit && stack[i - 1].dist < h.dist; i--) {
+                stack[i] = stack[i - 1];
+            }
+            stack[i] = h;
+        }
+    }
+
+    return closest;
+}
+
+} // end namespace detail
+
+// A BVH with up to Width (4 or 8) children per node, whose nodes store their
+// children's bounds quantised to 8 bits per plane, relative to a grid laid
+// over the node's own bounds. A node is 52 bytes (4-wide) or 80 bytes
+// (8-wide), against 32 bytes for each node of a binary bvh, which needs
+// about three (or seven) times as many, so the tree takes well under half
+// the memory, and more of it stays in cache while tracing.
+//
+// It is built by collapsing a binary bvh, and so is only as good as that
+// tree; it cannot be refitted, but collapsing is a quick linear pass, so
+// after things move the binary tree can be updated and collapsed again.
+// Each grid's origin is a float and its spacing a power of two, and every
+// quantised box is rounded outwards, so the decoded boxes always contain the
+// originals and the same things are hit as through the binary tree.
+//
+// The children of a node are tested against a ray together, four at a time
+// with SSE2 where available, and visited in order of distance.
+template <int Width>
+class compressed_bvh {
+    static_assert(Width == 4 || Width == 8, "compressed_bvh nodes have 4 or 8 children");
+
+public:
+    struct node {
+        // The grid's lower corner and, as powers of two, its spacing on
+        // each axis
+        float origin[3];
+        std::int8_t exponent[3];
+        std::uint8_t child_count;
+        // Interior children are stored together from child_base, and the
+        // primitives of leaf children together from prim_base
+        std::uint32_t child_base;
+        std::uint32_t prim_base;
+        // For each child, its offset from child_base (for interior
+        // children) or from prim_base (for leaves) in the low 5 bits, and
+        // for leaves the number of primitives in the top 3 bits
+        std::uint8_t meta[Width];
+        // Each child's bounds, as grid coordinates along each axis
+        std::uint8_t lower[3][Width];
+        std::uint8_t upper[3][Width];
+
+        bool is_leaf(int c) const { return (meta[c] >> 5) != 0; }
+    };
+
+    explicit compressed_bvh(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : nodes_(mr),
+              prims_(mr),
+              unbounded_(mr)
+    {}
+
+    explicit compressed_bvh(const bvh& tree, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : compressed_bvh(mr)
+    {
+        build(tree);
+    }
+
+    void build(const bvh& tree)
+    {
+        nodes_.clear();
+        prims_.clear();
+        unbounded_ = tree.get_unbounded();
+        detail::collapse_bvh<Width>(tree, nodes_, prims_, quantise_bounds);
+    }
+
+    const std::pmr::vector<node>& get_nodes() const { return nodes_; }
+
+    // The number of bytes taken by the nodes and index lists
+    std::size_t get_memory_size() const
+    {
+        return nodes_.size() * sizeof(node) + prims_.size() * sizeof(std::uint32_t) + unbounded_.get_memory_size();
+    }
+
+    // Finds the closest of the things hit by the ray (see test_closer())
+    template <typename Things>
+    intersection intersect(const ray& ray_, const Things& things) const
+    {
+        return traverse<false>(ray_, things, no_hit);
+    }
+
+    // Finds any thing hit by the ray closer than max_dist, for shadow rays
+    template <typename Things>
+    intersection intersect_any(const ray& ray_, const Things& things, real_t max_dist) const
+    {
+        return traverse<true>(ray_, things, max_dist);
+    }
+
+private:
+    static constexpr int min_exponent = -126;
+
+    template <bool AnyHit, typename Things>
+    intersection traverse(const ray& ray_, const Things& things, real_t max_dist) const
+    {
+        return detail::traverse_wide<AnyHit, Width>(
+                nodes_, prims_, unbounded_, ray_, things, max_dist,
+                [&](const node& n, const vec3& inv_dir, real_t max_d, real_t(&dist)[Width]) {
+                    return hit_children(n, ray_.start, inv_dir, max_d, dist);
+                });
+    }
+
+    static float decode(std::uint8_t q, float origin, float spacing)
+    {
+        return float(q) * spacing + origin;
+    }
+
+    // 2^exp, for exponents in the range of normal floats
+    static float get_spacing(int exp)
+    {
+        const std::uint32_t bits = std::uint32_t(exp + 127) << 23;
+        float spacing;
+        std::memcpy(&spacing, &bits, sizeof(spacing));
+        return spacing;
+    }
+
+    // Lays a grid of 255 steps over bounds, and rounds each child's bounds
+    // outwards onto it
+    static void quantise_bounds(node& n, const aabb& bounds, const aabb (&child_bounds)[Width])
+    {
+        for (int a = 0; a < 3; a++) {
+            const real_t lo = detail::axis(bounds.lower, a);
+            const real_t hi = detail::axis(bounds.upper, a);
+            float origin = float(lo);
+            if (origin > lo) {
+                origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+            }
+            int exp = min_exponent;
+            if (hi > origin) {
+                std::frexp(double(hi - origin) / 255, &exp);
+                exp = std::max(exp, min_exponent);
+                while (decode(255, origin, get_spacing(exp)) < hi) {
+                    exp++;
+                }
+            }
+            const float spacing = get_spacing(exp);
+            n.origin[a] = origin;
+            n.exponent[a] = std::int8_t(exp);
+
+            for (int c = 0; c < Width; c++) {
+                if (c >= n.child_count) {
+                    n.lower[a][c] = 255;
+                    n.upper[a][c] = 0;
+                    continue;
+                }
+                const real_t c_lo = detail::axis(child_bounds[c].lower, a);
+                const real_t c_hi = detail::axis(child_bounds[c].upper, a);
+                int q_lo = int(std::clamp<double>(std::floor((c_lo - origin) / spacing), 0, 255));
+                while (q_lo > 0 && decode(std::uint8_t(q_lo), origin, spacing) > c_lo) {
+                    q_lo--;
+                }
+                int q_hi = int(std::clamp<double>(std::ceil((c_hi - origin) / spacing), 0, 255));
+                while (q_hi < 255 && decode(std::uint8_t(q_hi), origin, spacing) < c_hi) {
+                    q_hi++;
+                }
+                n.lower[a][c] = std::uint8_t(q_lo);
+                n.upper[a][c] = std::uint8_t(q_hi);
+            }
+        }
+    }
+
+    // Slab-tests the ray against each of the node's children, returning a
+    // mask of those hit before max_dist, and their entry distances in dist
+    static unsigned hit_children(const node& n, const vec3& start, const vec3& inv_dir, real_t max_dist,
+                                 real_t (&dist)[Width])
+    {
+#ifdef RAYTRACER_HAVE_SSE2
+        if constexpr (std::is_same_v<real_t, float>) {
+            unsigned mask = 0;
+            for (int g = 0; g < Width; g += 4) {
+                mask |= hit_children_sse2(n, g, start, inv_dir, max_dist, dist + g) << g;
+            }
+            return mask & ((1u << n.child_count) - 1);
+        }
+#endif
+        unsigned mask = 0;
+        const float spacing[3] = {get_spacing(n.exponent[0]), get_spacing(n.exponent[1]), get_spacing(n.exponent[2])};
+        for (int c = 0; c < n.child_count; c++) {
+            real_t tmin = -no_hit;
+            real_t tmax = no_hit;
+            for (int a = 0; a < 3; a++) {
+                const real_t s = detail::axis(start, a);
+                const real_t inv = detail::axis(inv_dir, a);
+                const real_t t1 = (decode(n.lower[a][c], n.origin[a], spacing[a]) - s) * inv;
+                const real_t t2 = (decode(n.upper[a][c], n.origin[a], spacing[a]) - s) * inv;
+                tmin = std::max(tmin, std::min(t1, t2));
+                tmax = std::min(tmax, std::max(t1, t2));
+            }
+            if (tmax >= tmin && tmax >= 0 && tmin < max_dist) {
+                mask |= 1u << c;
+                dist[c] = tmin;
+            }
+        }
+        return mask;
+    }
+
+#ifdef RAYTRACER_HAVE_SSE2
+    // Tests children g to g + 3 at once, decoding their bounds on the fly
+    static unsigned hit_children_sse2(const node& n, int g, const vec3& start, const vec3& inv_dir,
+                                      real_t max_dist, real_t* dist)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const auto load = [&](const std::uint8_t* q, int a) {
+            std::int32_t bytes;
+            std::memcpy(&bytes, q + g, sizeof(bytes));
+            const __m128i q32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+            return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(q32), _mm_set1_ps(get_spacing(n.exponent[a]))),
+                              _mm_set1_ps(n.origin[a]));
+        };
+
+        __m128 tmin = _mm_set1_ps(-no_hit);
+        __m128 tmax = _mm_set1_ps(no_hit);
+        for (int a = 0; a < 3; a++) {
+            const __m128 s = _mm_set1_ps(float(detail::axis(start, a)));
+            const __m128 inv = _mm_set1_ps(float(detail::axis(inv_dir, a)));
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(load(n.lower[a], a), s), inv);
+            const __m128 t2 = _mm_mul_ps(_mm_sub_ps(load(n.upper[a], a), s), inv);
+            tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+            tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+        }
+        const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpge_ps(tmax, _mm_setzero_ps())),
+                                      _mm_cmplt_ps(tmin, _mm_set1_ps(float(max_dist))));
+        float t[4];
+        _mm_storeu_ps(t, tmin);
+        std::copy(t, t + 4, dist);
+        return unsigned(_mm_movemask_ps(hit));
+    }
+#endif
+
+    std::pmr::vector<node> nodes_;
+    std::pmr::vector<std::uint32_t> prims_;
+    unbounded_list unbounded_;
+};
+
+// A BVH with up to Width (4 or 8) children per node, collapsed from a binary
+// bvh like compressed_bvh, but keeping its children's bounds at full
+// precision, stored as a structure of arrays: each bound of each axis is
+// an array over the children. A ray is tested against all of a node's
+// children at once, with the eight lanes of an AVX2 vector for an 8-wide
+// node if the CPU supports it, and otherwise four at a time with SSE2 where
+// available.
+//
+// The tree takes a little more memory than the binary one (an 8-wide node
+// is 224 bytes, and there are a bit over a third as many nodes as
+// primitives), but a ray visits far fewer nodes, and the children it hits
+// are visited in order of distance. intersect_any() finds any hit before a
+// given distance, rather than the closest, for shadow rays.
+template <int Width>
+class wide_bvh {
+    static_assert(Width == 4 || Width == 8, "wide_bvh nodes have 4 or 8 children");
+
+public:
+    struct alignas(32) node {
+        // Each child's bounds, along each axis
+        real_t lower[3][Width];
+        real_t upper[3][Width];
+        // As for compressed_bvh::node
+        std::uint32_t child_base;
+        std::uint32_t prim_base;
+        std::uint8_t meta[Width];
+        std::uint8_t child_count;
+
+        bool is_leaf(int c) const { return (meta[c] >> 5) != 0; }
+    };
+
+    explicit wide_bvh(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : nodes_(mr),
+              prims_(mr),
+              unbounded_(mr)
+    {}
+
+    explicit wide_bvh(const bvh& tree, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+            : wide_bvh(mr)
+    {
+        build(tree);
+    }
+
+    void build(const bvh& tree)
+    {
+        nodes_.clear();
+        prims_.clear();
+        unbounded_ = tree.get_unbounded();
+        detail::collapse_bvh<Width>(tree, nodes_, prims_, [](node& n, const aabb&, const aabb (&child_bounds)[Width]) {
+            // Unused children get a point box at +infinity, which every ray
+            // misses: along each axis it is at t = +inf or t = -inf, so
+            // either tmin is +inf or tmax is -inf. (aabb::empty() would not
+            // do, as its inverted slabs let the slab test pass for any ray.)
+            // The kernels also mask these children out using child_count.
+            constexpr real_t inf = std::numeric_limits<real_t>::infinity();
+            const aabb unused{{inf, inf, inf}, {inf, inf, inf}};
+            for (int c = 0; c < Width; c++) {
+                const aabb b = c < n.child_count ? child_bounds[c] : unused;
+                for (int a = 0; a < 3; a++) {
+                    n.lower[a][c] = detail::axis(b.lower, a);
+                    n.upper[a][c] = detail::axis(b.upper, a);
+                }
+            }
+        });
+    }
+
+    const std::pmr::vector<node>& get_nodes() const { return nodes_; }
+
+    // The number of bytes taken by the nodes and index lists
+    std::size_t get_memory_size() const
+    {
+        return nodes_.size() * sizeof(node) + prims_.size() * sizeof(std::uint32_t) + unbounded_.get_memory_size();
+    }
+
+    // Finds the closest of the things hit by the ray (see test_closer())
+    template <typename Things>
+    intersection intersect(const ray& ray_, const Things& things) const
+    {
+        return traverse<false>(ray_, things, no_hit);
+    }
+
+    // Finds any thing hit by the ray closer than max_dist, for shadow rays
+    template <typename Things>
+    intersection intersect_any(const ray& ray_, const Things& things, real_t max_dist) const
+    {
+        return traverse<true>(ray_, things, max_dist);
+    }
+
+private:
+    template <bool AnyHit, typename Things>
+    intersection traverse(const ray& ray_, const Things& things, real_t max_dist) const
+    {
+#ifdef RAYTRACER_HAVE_AVX2_KERNEL
+        if constexpr (Width == 8 && std::is_same_v<real_t, float>) {
+            if (detail::cpu_has_avx2()) {
+                return detail::traverse_wide<AnyHit, Width>(
+                        nodes_, prims_, unbounded_, ray_, things, max_dist,
+                        [&](const node& n, const vec3& inv_dir, real_t max_d, real_t(&dist)[Width]) {
+                            return hit_children_avx2(n, ray_.start, inv_dir, max_d, dist);
+                        });
+            }
+        }
+#endif
+        return detail::traverse_wide<AnyHit, Width>(
+                nodes_, prims_, unbounded_, ray_, things, max_dist,
+                [&](const node& n, const vec3& inv_dir, real_t max_d, real_t(&dist)[Width]) {
+                    return hit_children(n, ray_.start, inv_dir, max_d, dist);
+                });
+    }
+
+    // Slab-tests the ray against each of the node's children, returning a
+    // mask of those hit before max_dist, and their entry distances in dist
+    static unsigned hit_children(const node& n, const vec3& start, const vec3& inv_dir, real_t max_dist,
+                                 real_t (&dist)[Width])
+    {
+#ifdef RAYTRACER_HAVE_SSE2
+        if constexpr (std::is_same_v<real_t, float>) {
+            unsigned mask = 0;
+            for (int g = 0; g < Width; g += 4) {
+                mask |= hit_children_sse2(n, g, start, inv_dir, max_dist, dist + g) << g;
+            }
+            return mask & ((1u << n.child_count) - 1);
+        }
+#endif
+        unsigned mask = 0;
+        for (int c = 0; c < n.child_count; c++) {
+            real_t tmin = -no_hit;
+            real_t tmax = no_hit;
+            for (int a = 0; a < 3; a++) {
+                const real_t t1 = (n.lower[a][c] - detail::axis(start, a)) * detail::axis(inv_dir, a);
+                const real_t t2 = (n.upper[a][c] - detail::axis(start, a)) * detail::axis(inv_dir, a);
+                tmin = std::max(tmin, std::min(t1, t2));
+                tmax = std::min(tmax, std::max(t1, t2));
+            }
+            if (tmax >= tmin && tmax >= 0 && tmin < max_dist) {
+                mask |= 1u << c;
+                dist[c] = tmin;
+            }
+        }
+        return mask;
+    }
+
+#ifdef RAYTRACER_HAVE_SSE2
+    // Tests children g to g + 3 at once; only used when real_t is float
+    static unsigned hit_children_sse2(const node& n, int g, const vec3& start, const vec3& inv_dir,
+                                      real_t max_dist, real_t* dist)
+    {
+        __m128 tmin = _mm_set1_ps(-no_hit);
+        __m128 tmax = _mm_set1_ps(no_hit);
+        for (int a = 0; a < 3; a++) {
+            const __m128 s = _mm_set1_ps(float(detail::axis(start, a)));
+            const __m128 inv = _mm_set1_ps(float(detail::axis(inv_dir, a)));
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.lower[a] + g), s), inv);
+            const __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.upper[a] + g), s), inv);
+            tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+            tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+        }
+        const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpge_ps(tmax, _mm_setzero_ps())),
+                                      _mm_cmplt_ps(tmin, _mm_set1_ps(float(max_dist))));
+        float t[4];
+        _mm_storeu_ps(t, tmin);
+        std::copy(t, t + 4, dist);
+        return unsigned(_mm_movemask_ps(hit));
+    }
+#endif
+
+#ifdef RAYTRACER_HAVE_AVX2_KERNEL
+    // Tests all eight children of an 8-wide node at once; only used when
+    // real_t is float
+    __attribute__((target("avx2")))
+    static unsigned hit_children_avx2(const node& n, const vec3& start, const vec3& inv_dir, real_t max_dist,
+                                      real_t (&dist)[Width])
+    {
+        __m256 tmin = _mm256_set1_ps(-no_hit);
+        __m256 tmax = _mm256_set1_ps(no_hit);
+        for (int a = 0; a < 3; a++) {
+            const __m256 s = _mm256_set1_ps(float(detail::axis(start, a)));
+            const __m256 inv = _mm256_set1_ps(float(detail::axis(inv_dir, a)));
+            const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.lower[a]), s), inv);
+            const __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.upper[a]), s), inv);
+            tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+            tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+        }
+        const __m256 hit = _mm256_and_ps(
+                _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ), _mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ)),
+                _mm256_cmp_ps(tmin, _mm256_set1_ps(float(max_dist)), _CMP_LT_OQ));
+        float t[8];
+        _mm256_storeu_ps(t, tmin);
+        std::copy(t, t + 8, dist);
+        return unsigned(_mm256_movemask_ps(hit)) & ((1u << n.child_count) - 1);
+    }
+#endif
+
+    std::pmr::vector<node> nodes_;
+    std::pmr::vector<std::uint32_t> prims_;
+    unbounded_list unbounded_;
+};
+
+} // end namespace rt